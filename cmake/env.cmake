@@ -8,15 +8,22 @@ set(EXECUTABLE_OUTPUT_PATH ${PROJECT_BINARY_DIR}/bin)
 #set(CMAKE_CXX_FLAGS "--std=c++11 -g -fmax-errors=1")
 set(CMAKE_CXX_FLAGS "--std=c++11 -g")
 
+# Solver timings are meaningless unoptimized, so default to an optimized build
+IF (NOT CMAKE_BUILD_TYPE)
+	SET(CMAKE_BUILD_TYPE RelWithDebInfo CACHE STRING "Build type" FORCE)
+ENDIF ()
+
 # Packages
-FIND_PACKAGE(OpenGL REQUIRED)
-INCLUDE_DIRECTORIES(${OPENGL_INCLUDE_DIRS})
-LINK_DIRECTORIES(${OPENGL_LIBRARY_DIRS})
-ADD_DEFINITIONS(${OPENGL_DEFINITIONS})
+IF (FLUID_BUILD_VIEWER)
+	FIND_PACKAGE(OpenGL REQUIRED)
+	INCLUDE_DIRECTORIES(${OPENGL_INCLUDE_DIRS})
+	LINK_DIRECTORIES(${OPENGL_LIBRARY_DIRS})
+	ADD_DEFINITIONS(${OPENGL_DEFINITIONS})
 
-MESSAGE(STATUS "OpenGL: ${OPENGL_LIBRARIES}")
-LIST(APPEND stdgl_libraries ${OPENGL_gl_LIBRARY})
+	MESSAGE(STATUS "OpenGL: ${OPENGL_LIBRARIES}")
+	LIST(APPEND stdgl_libraries ${OPENGL_gl_LIBRARY})
 
-if (APPLE)
-	FIND_LIBRARY(COCOA_LIBRARY Cocoa REQUIRED)
-endif(APPLE)
+	if (APPLE)
+		FIND_LIBRARY(COCOA_LIBRARY Cocoa REQUIRED)
+	endif(APPLE)
+ENDIF (FLUID_BUILD_VIEWER)
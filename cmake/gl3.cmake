@@ -1,12 +1,15 @@
-FIND_PACKAGE(GLEW REQUIRED)
-INCLUDE_DIRECTORIES(${GLEW_INCLUDE_DIRS})
-LINK_LIBRARIES(${GLEW_LIBRARIES})
+IF (FLUID_BUILD_VIEWER)
+	FIND_PACKAGE(GLEW REQUIRED)
+	INCLUDE_DIRECTORIES(${GLEW_INCLUDE_DIRS})
 
-FIND_PACKAGE(PkgConfig REQUIRED)
-pkg_search_module(GLFW3 REQUIRED glfw3)
-INCLUDE_DIRECTORIES(${GLFW3_INCLUDE_DIRS})
+	FIND_PACKAGE(PkgConfig REQUIRED)
+	pkg_search_module(GLFW3 REQUIRED glfw3)
+	INCLUDE_DIRECTORIES(${GLFW3_INCLUDE_DIRS})
 
-LIST(APPEND stdgl_libraries ${GLFW3_STATIC_LIBRARIES} ${GLEW_LIBRARIES})
+	# GLEW goes through stdgl_libraries only, so the headless targets
+	# never pick it up
+	LIST(APPEND stdgl_libraries ${GLFW3_STATIC_LIBRARIES} ${GLEW_LIBRARIES})
 
-message(STATUS "GLEW_LIBRARIES=${GLEW_LIBRARIES}")
-message(STATUS "GLFW_LIBRARIES=${GLFW3_STATIC_LIBRARIES}")
+	message(STATUS "GLEW_LIBRARIES=${GLEW_LIBRARIES}")
+	message(STATUS "GLFW_LIBRARIES=${GLFW3_STATIC_LIBRARIES}")
+ENDIF (FLUID_BUILD_VIEWER)
@@ -1,3 +1,5 @@
-AUX_SOURCE_DIRECTORY(${CMAKE_SOURCE_DIR}/lib libutgu_src)
-ADD_LIBRARY(utgraphicsutil STATIC ${libutgu_src})
-list(APPEND stdgl_libraries utgraphicsutil)
+IF (FLUID_BUILD_VIEWER)
+	AUX_SOURCE_DIRECTORY(${CMAKE_SOURCE_DIR}/lib libutgu_src)
+	ADD_LIBRARY(utgraphicsutil STATIC ${libutgu_src})
+	list(APPEND stdgl_libraries utgraphicsutil)
+ENDIF (FLUID_BUILD_VIEWER)
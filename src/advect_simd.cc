@@ -0,0 +1,265 @@
+#include <algorithm>
+#include "advect_simd.h"
+#include "parallel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ADVECT_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/**
+ * Raw view of the four grids taking part in one advection
+ */
+struct Advect_Args {
+    float* out;
+    const float* prev;
+    const float* u;
+    const float* v;
+    int N;
+    int stride;     // floats between two j rows
+    float dt0;
+};
+
+inline float lerp_cell(float v0, float v1, float t)
+{
+    return (1 - t)*v0 + t*v1;
+}
+
+/** Scalar reference for a single cell, mirrors Fluid_Sim::advect */
+inline void advect_cell(const Advect_Args& a, int i, int j)
+{
+    int k = i + a.stride * j;
+    float x = i - a.dt0 * a.u[k];
+    if (x < 0.5)            x = 0.5;
+    else if (x > a.N + 0.5) x = a.N + 0.5;
+    float y = j - a.dt0 * a.v[k];
+    if (y < 0.5)            y = 0.5;
+    else if (y > a.N + 0.5) y = a.N + 0.5;
+
+    int x_lo = (int) x;
+    int y_lo = (int) y;
+    float x_w = x - x_lo;
+    float y_w = y - y_lo;
+
+    const float* p = a.prev + x_lo + a.stride * y_lo;
+    a.out[k] = (1 - x_w) * lerp_cell(p[0], p[a.stride], y_w)
+                   + x_w * lerp_cell(p[1], p[1 + a.stride], y_w);
+}
+
+void advect_row_scalar(const Advect_Args& a, int j, int i, int end)
+{
+    for (; i <= end; ++i) {
+        advect_cell(a, i, j);
+    }
+}
+
+#ifdef ADVECT_SIMD_X86
+
+void advect_row_sse(const Advect_Args& a, int j, int i, int end)
+{
+    const __m128 lanes = _mm_setr_ps(0, 1, 2, 3);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 lo = _mm_set1_ps(0.5f);
+    const __m128 hi = _mm_set1_ps(a.N + 0.5f);
+    const __m128 dt0 = _mm_set1_ps(a.dt0);
+    const __m128 fj = _mm_set1_ps((float) j);
+
+    for (; i + 3 <= end; i += 4) {
+        int k = i + a.stride * j;
+        __m128 fi = _mm_add_ps(_mm_set1_ps((float) i), lanes);
+        __m128 x = _mm_sub_ps(fi, _mm_mul_ps(dt0, _mm_loadu_ps(a.u + k)));
+        __m128 y = _mm_sub_ps(fj, _mm_mul_ps(dt0, _mm_loadu_ps(a.v + k)));
+        x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+        y = _mm_min_ps(_mm_max_ps(y, lo), hi);
+
+        __m128i x_lo = _mm_cvttps_epi32(x);
+        __m128i y_lo = _mm_cvttps_epi32(y);
+        __m128 x_w = _mm_sub_ps(x, _mm_cvtepi32_ps(x_lo));
+        __m128 y_w = _mm_sub_ps(y, _mm_cvtepi32_ps(y_lo));
+
+        // No gather before AVX2, so load the four corners lane by lane
+        alignas(16) int xs[4], ys[4];
+        _mm_store_si128((__m128i*) xs, x_lo);
+        _mm_store_si128((__m128i*) ys, y_lo);
+        alignas(16) float c00[4], c01[4], c10[4], c11[4];
+        for (int l = 0; l < 4; ++l) {
+            const float* p = a.prev + xs[l] + a.stride * ys[l];
+            c00[l] = p[0];
+            c01[l] = p[a.stride];
+            c10[l] = p[1];
+            c11[l] = p[1 + a.stride];
+        }
+
+        __m128 y_w1 = _mm_sub_ps(one, y_w);
+        __m128 left  = _mm_add_ps(_mm_mul_ps(y_w1, _mm_load_ps(c00)),
+                                  _mm_mul_ps(y_w,  _mm_load_ps(c01)));
+        __m128 right = _mm_add_ps(_mm_mul_ps(y_w1, _mm_load_ps(c10)),
+                                  _mm_mul_ps(y_w,  _mm_load_ps(c11)));
+        __m128 out = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(one, x_w), left),
+                                _mm_mul_ps(x_w, right));
+        _mm_storeu_ps(a.out + k, out);
+    }
+    advect_row_scalar(a, j, i, end);
+}
+
+__attribute__((target("avx2")))
+void advect_row_avx2(const Advect_Args& a, int j, int i, int end)
+{
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 lo = _mm256_set1_ps(0.5f);
+    const __m256 hi = _mm256_set1_ps(a.N + 0.5f);
+    const __m256 dt0 = _mm256_set1_ps(a.dt0);
+    const __m256 fj = _mm256_set1_ps((float) j);
+    const __m256i stride = _mm256_set1_epi32(a.stride);
+
+    for (; i + 7 <= end; i += 8) {
+        int k = i + a.stride * j;
+        __m256 fi = _mm256_add_ps(_mm256_set1_ps((float) i), lanes);
+        __m256 x = _mm256_sub_ps(fi, _mm256_mul_ps(dt0, _mm256_loadu_ps(a.u + k)));
+        __m256 y = _mm256_sub_ps(fj, _mm256_mul_ps(dt0, _mm256_loadu_ps(a.v + k)));
+        x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+        y = _mm256_min_ps(_mm256_max_ps(y, lo), hi);
+
+        __m256i x_lo = _mm256_cvttps_epi32(x);
+        __m256i y_lo = _mm256_cvttps_epi32(y);
+        __m256 x_w = _mm256_sub_ps(x, _mm256_cvtepi32_ps(x_lo));
+        __m256 y_w = _mm256_sub_ps(y, _mm256_cvtepi32_ps(y_lo));
+
+        __m256i base = _mm256_add_epi32(x_lo, _mm256_mullo_epi32(y_lo, stride));
+        __m256i base_up = _mm256_add_epi32(base, stride);
+        __m256 c00 = _mm256_i32gather_ps(a.prev,     base,    4);
+        __m256 c01 = _mm256_i32gather_ps(a.prev,     base_up, 4);
+        __m256 c10 = _mm256_i32gather_ps(a.prev + 1, base,    4);
+        __m256 c11 = _mm256_i32gather_ps(a.prev + 1, base_up, 4);
+
+        __m256 y_w1 = _mm256_sub_ps(one, y_w);
+        __m256 left  = _mm256_add_ps(_mm256_mul_ps(y_w1, c00), _mm256_mul_ps(y_w, c01));
+        __m256 right = _mm256_add_ps(_mm256_mul_ps(y_w1, c10), _mm256_mul_ps(y_w, c11));
+        __m256 out = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(one, x_w), left),
+                                   _mm256_mul_ps(x_w, right));
+        _mm256_storeu_ps(a.out + k, out);
+    }
+    advect_row_scalar(a, j, i, end);
+}
+
+// GCC's AVX-512 conversion intrinsics start from deliberately undefined
+// registers, which -Wmaybe-uninitialized reports at every call site
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+void advect_row_avx512(const Advect_Args& a, int j, int i, int end)
+{
+    const __m512 lanes = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7,
+                                        8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 lo = _mm512_set1_ps(0.5f);
+    const __m512 hi = _mm512_set1_ps(a.N + 0.5f);
+    const __m512 dt0 = _mm512_set1_ps(a.dt0);
+    const __m512 fj = _mm512_set1_ps((float) j);
+    const __m512i stride = _mm512_set1_epi32(a.stride);
+
+    for (; i + 15 <= end; i += 16) {
+        int k = i + a.stride * j;
+        __m512 fi = _mm512_add_ps(_mm512_set1_ps((float) i), lanes);
+        __m512 x = _mm512_sub_ps(fi, _mm512_mul_ps(dt0, _mm512_loadu_ps(a.u + k)));
+        __m512 y = _mm512_sub_ps(fj, _mm512_mul_ps(dt0, _mm512_loadu_ps(a.v + k)));
+        x = _mm512_min_ps(_mm512_max_ps(x, lo), hi);
+        y = _mm512_min_ps(_mm512_max_ps(y, lo), hi);
+
+        __m512i x_lo = _mm512_cvttps_epi32(x);
+        __m512i y_lo = _mm512_cvttps_epi32(y);
+        __m512 x_w = _mm512_sub_ps(x, _mm512_cvtepi32_ps(x_lo));
+        __m512 y_w = _mm512_sub_ps(y, _mm512_cvtepi32_ps(y_lo));
+
+        __m512i base = _mm512_add_epi32(x_lo, _mm512_mullo_epi32(y_lo, stride));
+        __m512i base_up = _mm512_add_epi32(base, stride);
+        __m512 c00 = _mm512_i32gather_ps(base,    a.prev,     4);
+        __m512 c01 = _mm512_i32gather_ps(base_up, a.prev,     4);
+        __m512 c10 = _mm512_i32gather_ps(base,    a.prev + 1, 4);
+        __m512 c11 = _mm512_i32gather_ps(base_up, a.prev + 1, 4);
+
+        __m512 y_w1 = _mm512_sub_ps(one, y_w);
+        __m512 left  = _mm512_add_ps(_mm512_mul_ps(y_w1, c00), _mm512_mul_ps(y_w, c01));
+        __m512 right = _mm512_add_ps(_mm512_mul_ps(y_w1, c10), _mm512_mul_ps(y_w, c11));
+        __m512 out = _mm512_add_ps(_mm512_mul_ps(_mm512_sub_ps(one, x_w), left),
+                                   _mm512_mul_ps(x_w, right));
+        _mm512_storeu_ps(a.out + k, out);
+    }
+    advect_row_scalar(a, j, i, end);
+}
+
+#pragma GCC diagnostic pop
+
+#endif // ADVECT_SIMD_X86
+
+} // namespace
+
+Simd_Level detect_simd_level()
+{
+#ifdef ADVECT_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return Simd_AVX512;
+    if (__builtin_cpu_supports("avx2"))    return Simd_AVX2;
+    return Simd_SSE; // baseline on x86-64
+#else
+    return Simd_Scalar;
+#endif
+}
+
+const char* simd_level_name(Simd_Level level)
+{
+    switch (level) {
+        case Simd_SSE:    return "sse";
+        case Simd_AVX2:   return "avx2";
+        case Simd_AVX512: return "avx512";
+        default:          return "scalar";
+    }
+}
+
+void advect_simd(Simd_Level max_level, Fluid_Grid<float>& grid,
+        Fluid_Grid<float>& grid_prev, Fluid_Grid<float>& x_velocity,
+        Fluid_Grid<float>& y_velocity, float dt0, const Tile_Map* tiles)
+{
+    // Never go past what the CPU supports, whatever the caller asks for
+    static const Simd_Level supported = detect_simd_level();
+    Simd_Level level = (max_level < supported) ? max_level : supported;
+
+    Advect_Args a;
+    a.out = grid.array_;
+    a.prev = grid_prev.array_;
+    a.u = x_velocity.array_;
+    a.v = y_velocity.array_;
+    a.N = grid.N_;
+    a.stride = grid.stride_;
+    a.dt0 = dt0;
+
+    // Alongside other stages of a step, the rows share the threads
+    parallel_for(1, a.N + 1, [&](int j) {
+        // Runs of active tiles are advected as one span, the rest is zero
+        int ty = tiles ? Tile_Map::tile_of(j) : 0;
+        int count = tiles ? tiles->tiles_ : 1;
+        for (int tx = 0; tx < count; ) {
+            bool active = !tiles || tiles->active(tx, ty);
+            int begin = tiles ? tiles->first(tx) : 1;
+            while (++tx < count && tiles->active(tx, ty) == active) {
+            }
+            int end = tiles ? tiles->last(tx - 1) : a.N;
+            if (!active) {
+                std::fill(a.out + begin + a.stride * j, a.out + end + 1 + a.stride * j, 0.0f);
+                continue;
+            }
+            switch (level) {
+#ifdef ADVECT_SIMD_X86
+                case Simd_AVX512: advect_row_avx512(a, j, begin, end); break;
+                case Simd_AVX2:   advect_row_avx2(a, j, begin, end);   break;
+                case Simd_SSE:    advect_row_sse(a, j, begin, end);    break;
+#endif
+                default:          advect_row_scalar(a, j, begin, end); break;
+            }
+        }
+    });
+}
@@ -0,0 +1,38 @@
+#ifndef ADVECT_SIMD_H
+#define ADVECT_SIMD_H
+
+#include "grid.h"
+#include "tiles.h"
+
+/**
+ * Instruction sets the vectorized kernels can be built for, narrowest first
+ */
+enum Simd_Level
+{
+    Simd_Scalar,
+    Simd_SSE,      // 4 lanes, scalar loads for the gathers
+    Simd_AVX2,     // 8 lanes, hardware gathers
+    Simd_AVX512    // 16 lanes, hardware gathers
+};
+
+/** Widest instruction set supported by the running CPU */
+Simd_Level detect_simd_level();
+
+/** Printable name of a Simd_Level */
+const char* simd_level_name(Simd_Level level);
+
+/**
+ * Vectorized semi-Lagrangian advection of the interior of grid, using the
+ * widest kernel not above max_level. Computes the same expressions in the
+ * same order as the scalar Fluid_Sim::advect loop, without FMA contraction,
+ * so both paths agree bit for bit. Boundaries are left to the caller.
+ * All four grids must share N and row stride.
+ * @param dt0 time step times N, how far back to trace in cells
+ * @param tiles if given, only its active tiles are advected and the cells
+ *     of the others are set to zero
+ */
+void advect_simd(Simd_Level max_level, Fluid_Grid<float>& grid,
+        Fluid_Grid<float>& grid_prev, Fluid_Grid<float>& x_velocity,
+        Fluid_Grid<float>& y_velocity, float dt0, const Tile_Map* tiles = 0);
+
+#endif // ADVECT_SIMD_H
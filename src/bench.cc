@@ -0,0 +1,458 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fluid.h"
+
+/**
+ * Per-kernel micro-benchmarks for the stages of Fluid_Sim::simulation_step.
+ * Each stage is timed in isolation over a sweep of grid sizes and thread
+ * counts, and reported as ns/cell, effective GB/s (from a bytes-per-cell
+ * model of the kernel's streaming traffic) and speedup over one thread.
+ */
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct Kernel_Bench {
+    std::string name;
+    double cells;                   // cells touched per call
+    double bytes;                   // bytes streamed per call
+    std::function<void()> run;
+};
+
+static void usage(const char* program)
+{
+    std::cerr << "usage: " << program << " [options]\n"
+              << "  -min <int>       smallest N of the sweep (default 64)\n"
+              << "  -max <int>       largest N of the sweep (default 4096)\n"
+              << "  -threads <int>   largest thread count (default: all)\n"
+              << "  -kernel <name>   only run kernels whose name contains <name>\n"
+              << "  -time <float>    minimum seconds spent per measurement (default 0.25)\n"
+              << "  -warm-max <int>  largest N of the warm start study (default 1024)\n"
+              << "  -warm-steps <int> simulation steps per warm start run (default 10)\n"
+              << "  -sparse-steps <int> steps run before timing the sleeping tiles\n"
+              << "                   study (default 20)\n";
+}
+
+/** Deterministic, smooth-ish data so the solvers do representative work */
+static void fill(Fluid_Grid<float>& grid, float scale, int seed)
+{
+    unsigned state = 2166136261u ^ seed;
+    int N = grid.N_;
+    for (int j = 0; j <= N + 1; ++j) {
+        for (int i = 0; i <= N + 1; ++i) {
+            state = state * 1664525u + 1013904223u;
+            grid(i, j) = scale * ((state >> 8) / (float)(1 << 24) - 0.5f);
+        }
+    }
+}
+
+/**
+ * Run a short scripted simulation and return the mean pressure solver
+ * iterations per solve, with or without warm starts
+ */
+static double pressure_iterations(int N, Projection_Solver solver, bool warm_start,
+        int steps, float* worst_residual)
+{
+    Fluid_Sim sim(N, 0.0f, 0.0f, 0.125f);
+    sim.projection_ = solver;
+    sim.warm_start_ = warm_start;
+
+    long iterations = 0;
+    *worst_residual = 0.0f;
+    for (int step = 0; step < steps; ++step) {
+        // Stir the middle of the domain and keep dye flowing into it
+        int c = N / 2;
+        sim.x_source.set(c, c, 50.0f);
+        sim.y_source.set(c, c + N / 8, -50.0f);
+        sim.density_source.set(c, c, 250.0f);
+        sim.simulation_step();
+        for (int s = 0; s < 2; ++s) {
+            iterations += sim.step_stats().pressure[s].iterations;
+            *worst_residual = std::max(*worst_residual, sim.step_stats().pressure[s].residual);
+        }
+    }
+    return iterations / (2.0 * steps);
+}
+
+/** Run a kernel until min_time has elapsed, return seconds per call */
+static double time_kernel(const std::function<void()>& run, double min_time)
+{
+    run(); // warm caches and page in the grids
+
+    int reps = 0;
+    double elapsed = 0.0;
+    bench_clock::time_point beg = bench_clock::now();
+    do {
+        run();
+        ++reps;
+        elapsed = std::chrono::duration<double>(bench_clock::now() - beg).count();
+    } while (elapsed < min_time);
+    return elapsed / reps;
+}
+
+/**
+ * Dense and sleeping-tile timings of one kernel on a sparse scene
+ * @returns Fraction of tiles the sparse kernel processes
+ */
+static double sparse_timing(Fluid_Sim& sim, const std::function<void()>& run,
+        double min_time, double* dense, double* sparse)
+{
+    sim.sleep_tiles_ = false;
+    *dense = time_kernel(run, min_time);
+    sim.sleep_tiles_ = true;
+    *sparse = time_kernel(run, min_time);
+    sim.stats_.tiles_awake = sim.stats_.tiles_total = 0;
+    run();
+    return sim.stats_.tiles_total > 0
+        ? (double) sim.stats_.tiles_awake / sim.stats_.tiles_total : 1.0;
+}
+
+int main(int argc, char* argv[])
+{
+    int min_N = 64;
+    int max_N = 4096;
+    int max_threads = 1;
+    double min_time = 0.25;
+    int warm_max_N = 1024;
+    int warm_steps = 10;
+    int sparse_steps = 20;
+    std::string filter;
+#ifdef _OPENMP
+    max_threads = omp_get_max_threads();
+#endif
+
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        bool has_value = a + 1 < argc;
+        if (arg == "-min" && has_value) {
+            min_N = std::atoi(argv[++a]);
+        } else if (arg == "-max" && has_value) {
+            max_N = std::atoi(argv[++a]);
+        } else if (arg == "-threads" && has_value) {
+            max_threads = std::atoi(argv[++a]);
+        } else if (arg == "-kernel" && has_value) {
+            filter = argv[++a];
+        } else if (arg == "-time" && has_value) {
+            min_time = std::atof(argv[++a]);
+        } else if (arg == "-warm-max" && has_value) {
+            warm_max_N = std::atoi(argv[++a]);
+        } else if (arg == "-warm-steps" && has_value) {
+            warm_steps = std::atoi(argv[++a]);
+        } else if (arg == "-sparse-steps" && has_value) {
+            sparse_steps = std::atoi(argv[++a]);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (min_N < 4 || max_N < min_N || max_threads < 1 || warm_steps < 1
+            || sparse_steps < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Simd_Level best_simd = detect_simd_level();
+
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+
+    printf("%-34s %6s %8s %12s %10s %9s\n",
+            "kernel", "N", "threads", "ns/cell", "GB/s", "speedup");
+
+    for (int N = min_N; N <= max_N; N *= 2) {
+        Fluid_Sim sim(N, 0.0001f, 0.0001f, 0.125f);
+        fill(sim.x, 1.0f, 1);           fill(sim.x_old, 1.0f, 2);
+        fill(sim.y, 1.0f, 3);           fill(sim.y_old, 1.0f, 4);
+        fill(sim.density, 100.0f, 5);   fill(sim.density_old, 100.0f, 6);
+
+        double cells    = (double) N * N;
+        // Time a fixed amount of work: a negative tolerance is never met, so
+        // the relaxations run every sweep even once converged
+        Solver_Control fixed = { -1.0f, 30 };
+        sim.viscosity_control_ = sim.density_control_ = sim.pressure_control_ = fixed;
+        double sweeps   = fixed.max_iterations;
+        float a = sim.time_step_ * sim.diffusion_ * N * N;
+        float c = 1 + 4 * a;
+
+        std::vector<Kernel_Bench> kernels;
+        // Sources are sparse: one 8x8 brush, the size of the viewer's
+        kernels.push_back(Kernel_Bench{"add_external_forces", 64.0, 64.0 * 12,
+                [&]() { for (int j = N/2 - 4; j < N/2 + 4; ++j) {
+                            for (int i = N/2 - 4; i < N/2 + 4; ++i) {
+                                sim.density_source.set(i, j, 250.0f);
+                            }
+                        }
+                        sim.add_external_forces(sim.density, sim.density_source); }});
+        kernels.push_back(Kernel_Bench{"gauss_seidel", cells * sweeps,
+                cells * sweeps * 12,
+                [&]() { sim.relaxation_ = Lexicographic;
+                        sim.gauss_seidel(sim.density, sim.density_old, a, c, fixed); }});
+        kernels.push_back(Kernel_Bench{"gauss_seidel[rb]", cells * sweeps,
+                cells * sweeps * 12,
+                [&]() { sim.relaxation_ = Red_Black;
+                        sim.gauss_seidel(sim.density, sim.density_old, a, c, fixed); }});
+        kernels.push_back(Kernel_Bench{"gauss_seidel[wavefront]", cells * sweeps,
+                cells * sweeps * 12,
+                [&]() { sim.relaxation_ = Red_Black_Wavefront;
+                        sim.gauss_seidel(sim.density, sim.density_old, a, c, fixed); }});
+        kernels.push_back(Kernel_Bench{"gauss_seidel_viscosity", cells * sweeps,
+                cells * sweeps * 16,
+                [&]() { sim.relaxation_ = Lexicographic;
+                        sim.gauss_seidel_viscosity(sim.x, sim.x_old); }});
+        kernels.push_back(Kernel_Bench{"gauss_seidel_viscosity[rb]", cells * sweeps,
+                cells * sweeps * 16,
+                [&]() { sim.relaxation_ = Red_Black;
+                        sim.gauss_seidel_viscosity(sim.x, sim.x_old); }});
+        kernels.push_back(Kernel_Bench{"gauss_seidel_viscosity[wavefront]", cells * sweeps,
+                cells * sweeps * 16,
+                [&]() { sim.relaxation_ = Red_Black_Wavefront;
+                        sim.gauss_seidel_viscosity(sim.x, sim.x_old); }});
+        // Both velocity components, as simulation_step diffuses them
+        kernels.push_back(Kernel_Bench{"gauss_seidel_viscosity[rb,x+y]", 2 * cells * sweeps,
+                2 * cells * sweeps * 16,
+                [&]() { sim.relaxation_ = Red_Black;
+                        sim.gauss_seidel_viscosity(sim.x, sim.x_old);
+                        sim.gauss_seidel_viscosity(sim.y, sim.y_old); }});
+        kernels.push_back(Kernel_Bench{"gauss_seidel_viscosity[rb,fused]", 2 * cells * sweeps,
+                cells * sweeps * 28,
+                [&]() { sim.relaxation_ = Red_Black;
+                        sim.gauss_seidel_viscosity(sim.x, sim.x_old, sim.y, sim.y_old); }});
+        kernels.push_back(Kernel_Bench{"project", cells * (sweeps + 2),
+                cells * (36 + sweeps * 12),
+                [&]() { sim.projection_ = Gauss_Seidel_Projection;
+                        sim.project(sim.x, sim.y, sim.x_old, sim.y_old); }});
+        kernels.push_back(Kernel_Bench{"project[mg]", cells,
+                cells * 36,
+                [&]() { sim.projection_ = Multigrid_Projection;
+                        sim.project(sim.x, sim.y, sim.x_old, sim.y_old); }});
+        kernels.push_back(Kernel_Bench{"project[pcg]", cells,
+                cells * 36,
+                [&]() { sim.projection_ = PCG_Projection;
+                        sim.project(sim.x, sim.y, sim.x_old, sim.y_old); }});
+        kernels.push_back(Kernel_Bench{"advect", cells,
+                cells * 16,
+                [&]() { sim.simd_ = Simd_Scalar;
+                        sim.advect(sim.density, sim.density_old, sim.x, sim.y); }});
+        kernels.push_back(Kernel_Bench{std::string("advect[") + simd_level_name(best_simd) + "]",
+                cells, cells * 16,
+                [&]() { sim.simd_ = best_simd;
+                        sim.advect(sim.density, sim.density_old, sim.x, sim.y); }});
+        // A pool with a round island in it; the narrow band makes surface
+        // extraction scale with the length of its outline
+        for (int j = 0; j <= N + 1; ++j) {
+            for (int i = 0; i <= N + 1; ++i) {
+                float dx = i - 0.5f * N, dy = j - 0.4f * N;
+                sim.levelset.dist_grid(i, j) = std::max(j - 0.7f * N,
+                        0.2f * N - std::sqrt(dx * dx + dy * dy));
+            }
+        }
+        sim.levelset.classify();
+        kernels.push_back(Kernel_Bench{"levelset.classify", cells,
+                cells * 4,
+                [&]() { sim.levelset.classify(); }});
+        kernels.push_back(Kernel_Bench{"extract_surface", cells,
+                cells / 8,
+                [&]() { sim.levelset.extract_surface(); }});
+        kernels.push_back(Kernel_Bench{"levelset.redistance", cells,
+                cells / 8,
+                [&]() { sim.levelset.redistance(); }});
+        // Half a cell per call, so every other one redistances too
+        kernels.push_back(Kernel_Bench{"levelset.advect", cells,
+                cells / 8,
+                [&]() { sim.levelset.advect(sim.x, sim.y, 0.5f, 1.0f); }});
+        kernels.push_back(Kernel_Bench{"adjust_bounds", 4.0 * N,
+                4.0 * N * 8,
+                [&]() { sim.adjust_bounds(sim.density); }});
+
+        for (size_t k = 0; k < kernels.size(); ++k) {
+            sim.relaxation_ = Lexicographic;
+            sim.projection_ = Gauss_Seidel_Projection;
+            sim.simd_ = Simd_Scalar;
+            const Kernel_Bench& kernel = kernels[k];
+            if (kernel.name.find(filter) == std::string::npos) {
+                continue;
+            }
+
+            double single_thread = 0.0;
+            for (size_t t = 0; t < thread_counts.size(); ++t) {
+#ifdef _OPENMP
+                omp_set_num_threads(thread_counts[t]);
+#endif
+                double seconds = time_kernel(kernel.run, min_time);
+                if (t == 0) {
+                    single_thread = seconds;
+                }
+                printf("%-34s %6d %8d %12.3f %10.2f %8.2fx\n",
+                        kernel.name.c_str(), N, thread_counts[t],
+                        seconds * 1e9 / kernel.cells,
+                        kernel.bytes / seconds * 1e-9,
+                        single_thread / seconds);
+                fflush(stdout);
+            }
+        }
+    }
+
+    // Iterations saved by seeding each pressure solve with the last pressure
+    printf("\n%-34s %6s %12s %12s %9s %12s\n",
+            "warm start", "N", "cold it/sv", "warm it/sv", "saved", "worst res");
+    for (int N = min_N; N <= std::min(max_N, warm_max_N); N *= 2) {
+        const Projection_Solver solvers[] = { Multigrid_Projection, PCG_Projection };
+        const char* names[] = { "project[mg]", "project[pcg]" };
+        for (int s = 0; s < 2; ++s) {
+            if (std::string(names[s]).find(filter) == std::string::npos) {
+                continue;
+            }
+            float cold_residual, warm_residual;
+            double cold = pressure_iterations(N, solvers[s], false, warm_steps, &cold_residual);
+            double warm = pressure_iterations(N, solvers[s], true, warm_steps, &warm_residual);
+            printf("%-34s %6d %12.2f %12.2f %8.1f%% %12.2e\n", names[s], N, cold, warm,
+                    cold > 0.0 ? 100.0 * (cold - warm) / cold : 0.0,
+                    std::max(cold_residual, warm_residual));
+            fflush(stdout);
+        }
+    }
+
+    // Dye and motion confined to one corner: what skipping the still,
+    // empty tiles saves over processing every cell
+    printf("\n%-34s %6s %12s %12s %9s %9s\n",
+            "sleeping tiles", "N", "dense ms", "sparse ms", "awake", "speedup");
+    for (int N = min_N; N <= max_N; N *= 2) {
+        Fluid_Sim sim(N, 0.0001f, 0.0001f, 0.125f / N);
+        sim.relaxation_ = Red_Black;
+        for (int step = 0; step < sparse_steps; ++step) {
+            int c = N / 8;
+            sim.inject(Injection::splat(c, c, 250.0f, std::max(N / 64, 1)));
+            sim.inject(Injection::impulse(c, c, 50.0f, 25.0f));
+            sim.sleep_tiles_ = true;
+            sim.simulation_step();
+        }
+
+        struct {
+            const char* name;
+            std::function<void()> run;
+        } stages[] = {
+            // The velocity is as the step's last project left it, measured
+            { "advect[tiles]", [&]() {
+                  sim.advect(sim.x_old, sim.density, sim.x, sim.y, true); } },
+            { "diffuse[tiles]", [&]() {
+                  sim.diffuse(sim.x_old, sim.density, sim.diffusion_); } },
+            { "diffuse_viscosity[tiles]", [&]() {
+                  sim.diffuse_viscosity(sim.x_old, sim.x); } },
+        };
+        for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); ++s) {
+            if (std::string(stages[s].name).find(filter) == std::string::npos) {
+                continue;
+            }
+            double dense, sparse;
+            double awake = sparse_timing(sim, stages[s].run, min_time, &dense, &sparse);
+            printf("%-34s %6d %12.3f %12.3f %8.1f%% %8.2fx\n", stages[s].name, N,
+                    dense * 1e3, sparse * 1e3, 100.0 * awake, dense / sparse);
+            fflush(stdout);
+        }
+    }
+
+    // The solvers with the grid dimension a compile-time constant, at the
+    // sizes that have a build of their own, against the generic kernels
+    printf("\n%-34s %6s %12s %12s %9s\n",
+            "fixed size kernels", "N", "generic ns", "fixed ns", "speedup");
+    for (int N = std::max(min_N, 128); N <= std::min(max_N, 1024); N *= 2) {
+        Fluid_Sim sim(N, 0.0001f, 0.0001f, 0.125f);
+        fill(sim.x, 1.0f, 1);           fill(sim.x_old, 1.0f, 2);
+        fill(sim.y, 1.0f, 3);           fill(sim.y_old, 1.0f, 4);
+        fill(sim.density, 100.0f, 5);   fill(sim.density_old, 100.0f, 6);
+        Solver_Control fixed = { -1.0f, 30 };
+        sim.viscosity_control_ = sim.density_control_ = sim.pressure_control_ = fixed;
+        float a = sim.time_step_ * sim.diffusion_ * N * N;
+        float c = 1 + 4 * a;
+        double cells = (double) N * N;
+
+        struct {
+            const char* name;
+            Relaxation_Order order;
+            double cells;
+            std::function<void()> run;
+        } stages[] = {
+            { "gauss_seidel", Lexicographic, cells * fixed.max_iterations, [&]() {
+                  sim.gauss_seidel(sim.density, sim.density_old, a, c, fixed); } },
+            { "gauss_seidel[rb]", Red_Black, cells * fixed.max_iterations, [&]() {
+                  sim.gauss_seidel(sim.density, sim.density_old, a, c, fixed); } },
+            { "gauss_seidel[wavefront]", Red_Black_Wavefront, cells * fixed.max_iterations,
+                  [&]() { sim.gauss_seidel(sim.density, sim.density_old, a, c, fixed); } },
+            { "gauss_seidel_viscosity[rb,fused]", Red_Black, 2 * cells * fixed.max_iterations,
+                  [&]() { sim.gauss_seidel_viscosity(sim.x, sim.x_old, sim.y, sim.y_old); } },
+            { "project", Red_Black, cells * (fixed.max_iterations + 2), [&]() {
+                  sim.project(sim.x, sim.y, sim.pressure, sim.x_old); } },
+        };
+        for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); ++s) {
+            if (std::string(stages[s].name).find(filter) == std::string::npos) {
+                continue;
+            }
+            sim.relaxation_ = stages[s].order;
+            sim.fixed_size_kernels_ = false;
+            double generic = time_kernel(stages[s].run, min_time);
+            sim.fixed_size_kernels_ = true;
+            double specialized = time_kernel(stages[s].run, min_time);
+            printf("%-34s %6d %12.3f %12.3f %8.2fx\n", stages[s].name, N,
+                    generic * 1e9 / stages[s].cells, specialized * 1e9 / stages[s].cells,
+                    generic / specialized);
+            fflush(stdout);
+        }
+    }
+
+    // Whole steps, each stage parallel on its own against the stages of a
+    // step run as a task graph, the critical path of the graph, and how
+    // many stages the graph had in flight on average
+    printf("\n%-34s %6s %8s %12s %12s %12s %9s %9s\n", "task graph", "N", "threads",
+            "stages ms", "graph ms", "critical ms", "overlap", "speedup");
+    for (int N = min_N; N <= std::min(max_N, 1024); N *= 2) {
+        if (std::string("step[tasks]").find(filter) == std::string::npos) {
+            break;
+        }
+        Fluid_Sim sim(N, 0.0001f, 0.0001f, 0.125f / N);
+        sim.relaxation_ = Red_Black;
+        // Same work every step, however far the scene has evolved
+        Solver_Control fixed = { -1.0f, 30 };
+        sim.viscosity_control_ = sim.density_control_ = sim.pressure_control_ = fixed;
+        auto step = [&]() {
+            int c = N / 2;
+            sim.x_source.set(c, c, 50.0f);
+            sim.y_source.set(c, c + N / 8, -50.0f);
+            sim.density_source.set(c, c, 250.0f);
+            sim.simulation_step();
+        };
+        // Past the first steps, which run slow while the fields are all
+        // but zero
+        for (int k = 0; k < warm_steps; ++k) {
+            step();
+        }
+        for (size_t t = 0; t < thread_counts.size(); ++t) {
+#ifdef _OPENMP
+            omp_set_num_threads(thread_counts[t]);
+#endif
+            sim.task_graph_ = false;
+            double stages = time_kernel(step, min_time);
+            sim.task_graph_ = true;
+            double graph = time_kernel(step, min_time);
+            const Task_Graph& tasks = sim.step_graph_;
+            printf("%-34s %6d %8d %12.3f %12.3f %12.3f %9.2f %8.2fx\n", "step[tasks]", N,
+                    thread_counts[t], stages * 1e3, graph * 1e3,
+                    tasks.critical_path() * 1e3, tasks.busy() / tasks.elapsed(),
+                    stages / graph);
+            fflush(stdout);
+        }
+    }
+    return EXIT_SUCCESS;
+}
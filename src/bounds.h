@@ -0,0 +1,106 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include "grid.h"
+
+/**
+ * Boundary conditions of a kind of grid, resolved at compile time. Ghost
+ * cells mirror the interior cell next to them; a velocity component is
+ * negated at the two walls it is normal to, so no flow crosses them.
+ * Density and None grids share the plain copy of Bounds<None>.
+ */
+template <Grid_Type Type>
+struct Bounds {
+    /** Ghost value across the left and right walls */
+    static float side(float v) { return (Type == X_Velocity) ? -v : v; }
+
+    /** Ghost value across the bottom and top walls */
+    static float end(float v) { return (Type == Y_Velocity) ? -v : v; }
+
+    /**
+     * Refresh the ghost cells bordering interior cells [i0, i1] x [j0, j1],
+     * and the corners next to them, once those cells are final. Sweeps call
+     * it on the row, column or tile they just finished, so the edges never
+     * need a pass of their own.
+     */
+    static void region(Fluid_Grid<float>& grid, int i0, int i1, int j0, int j1) {
+        int N = grid.N_;
+        if (i0 == 1) {
+            for (int j = j0; j <= j1; ++j) {
+                grid(0, j) = side(grid(1, j));
+            }
+        }
+        if (i1 == N) {
+            for (int j = j0; j <= j1; ++j) {
+                grid(N+1, j) = side(grid(N, j));
+            }
+        }
+        if (j0 == 1) {
+            for (int i = i0; i <= i1; ++i) {
+                grid(i, 0) = end(grid(i, 1));
+            }
+        }
+        if (j1 == N) {
+            for (int i = i0; i <= i1; ++i) {
+                grid(i, N+1) = end(grid(i, N));
+            }
+        }
+
+        // Corners -- average out the two nearest
+        if (i0 == 1 && j0 == 1) {
+            grid(0, 0) = 0.5f * (grid(1, 0) + grid(0, 1));
+        }
+        if (i0 == 1 && j1 == N) {
+            grid(0, N+1) = 0.5f * (grid(1, N+1) + grid(0, N));
+        }
+        if (i1 == N && j0 == 1) {
+            grid(N+1, 0) = 0.5f * (grid(N, 0) + grid(N+1, 1));
+        }
+        if (i1 == N && j1 == N) {
+            grid(N+1, N+1) = 0.5f * (grid(N, N+1) + grid(N+1, N));
+        }
+    }
+
+    /** Ghost cells of interior row j, plus those of row 0 or N+1 next to it */
+    static void row(Fluid_Grid<float>& grid, int j) {
+        region(grid, 1, grid.N_, j, j);
+    }
+
+    /** Ghost cells of interior column i, plus those of column 0 or N+1 */
+    static void column(Fluid_Grid<float>& grid, int i) {
+        region(grid, i, i, 1, grid.N_);
+    }
+
+    /** Every ghost cell, all four edges in one loop */
+    static void apply(Fluid_Grid<float>& grid) {
+        int N = grid.N_;
+        for (int k = 1; k <= N; ++k) {
+            grid(0,   k) = side(grid(1, k));
+            grid(N+1, k) = side(grid(N, k));
+            grid(k,   0) = end(grid(k, 1));
+            grid(k, N+1) = end(grid(k, N));
+        }
+        grid(0,     0) = 0.5f * (grid(1,     0) + grid(0,    1));
+        grid(0,   N+1) = 0.5f * (grid(1,   N+1) + grid(0,    N));
+        grid(N+1,   0) = 0.5f * (grid(N,     0) + grid(N+1,  1));
+        grid(N+1, N+1) = 0.5f * (grid(N,   N+1) + grid(N+1,  N));
+    }
+};
+
+/** Bounds<type>::apply, for a type only known at run time */
+inline void apply_bounds(Fluid_Grid<float>& grid, Grid_Type type)
+{
+    switch (type) {
+    case X_Velocity:
+        Bounds<X_Velocity>::apply(grid);
+        break;
+    case Y_Velocity:
+        Bounds<Y_Velocity>::apply(grid);
+        break;
+    default:
+        Bounds<None>::apply(grid);
+        break;
+    }
+}
+
+#endif // BOUNDS_H
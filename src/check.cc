@@ -0,0 +1,216 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "fluid.h"
+
+/**
+ * Equivalence checks for the fast paths of Fluid_Sim. Each check runs two
+ * simulations on the same scripted sources, one with the reference code
+ * path and one with the variant, and compares every cell of the fields
+ * after every step bit for bit. The variants only vectorize, reorder or skip
+ * work without changing its result, so any difference at all is a bug. Exits
+ * non-zero when a check fails.
+ */
+
+struct Check {
+    std::string name;
+    int N;
+    std::function<void(Fluid_Sim&)> reference;
+    std::function<void(Fluid_Sim&)> variant;
+};
+
+static void usage(const char* program)
+{
+    std::cerr << "usage: " << program << " [options]\n"
+              << "  -steps <int>     simulation steps per check (default 40)\n"
+              << "  -check <name>    only run checks whose name contains <name>\n";
+}
+
+/**
+ * Sources of step: dye and a swirl near one corner, so the rest of the grid
+ * stays at rest for a while, and a jet across the middle later on
+ */
+static void stir(Fluid_Sim& sim, int step)
+{
+    int N = sim.N_;
+    int c = N / 4;
+    if (step < 20) {
+        sim.density_source.set(c, c, 250.0f);
+        sim.x_source.set(c, c + 2, 40.0f);
+        sim.y_source.set(c + 2, c, -30.0f);
+    }
+    if (step >= 10 && step < 30) {
+        sim.x_source.set(N / 2, N / 2 + 3, -60.0f);
+        sim.y_source.set(N / 2 + 5, N / 2, 20.0f);
+        sim.density_source.set(N / 2, N / 2 + 3, 100.0f);
+    }
+}
+
+/**
+ * First cell where a and b differ in any bit, ghost cells included
+ * @returns false if there is none
+ */
+static bool differ(const Fluid_Grid<float>& a, const Fluid_Grid<float>& b,
+        int* i, int* j)
+{
+    int N = a.N_;
+    for (*j = 0; *j <= N + 1; ++*j) {
+        for (*i = 0; *i <= N + 1; ++*i) {
+            if (memcmp(&a(*i, *j), &b(*i, *j), sizeof(float)) != 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/** Run check for steps steps, report the first mismatch */
+static bool run_check(const Check& check, int steps)
+{
+    Fluid_Sim reference(check.N, 0.0001f, 0.0001f, 0.125f);
+    Fluid_Sim variant(check.N, 0.0001f, 0.0001f, 0.125f);
+    check.reference(reference);
+    check.variant(variant);
+
+    struct Field {
+        const char* name;
+        Fluid_Grid<float> Fluid_Sim::* grid;
+    };
+    const Field fields[] = {
+        { "x", &Fluid_Sim::x },
+        { "y", &Fluid_Sim::y },
+        { "density", &Fluid_Sim::density },
+        { "pressure", &Fluid_Sim::pressure },
+        { "pressure_advect", &Fluid_Sim::pressure_advect }
+    };
+
+    for (int step = 0; step < steps; ++step) {
+        stir(reference, step);
+        stir(variant, step);
+        reference.simulation_step();
+        variant.simulation_step();
+
+        for (const Field& field : fields) {
+            int i, j;
+            const Fluid_Grid<float>& a = reference.*field.grid;
+            const Fluid_Grid<float>& b = variant.*field.grid;
+            if (differ(a, b, &i, &j)) {
+                printf("FAIL %-32s step %d: %s(%d, %d) is %.9g, not %.9g\n",
+                        check.name.c_str(), step, field.name, i, j, b(i, j),
+                        a(i, j));
+                return false;
+            }
+        }
+    }
+    printf("ok   %-32s N=%d, %d steps\n", check.name.c_str(), check.N, steps);
+    return true;
+}
+
+/** Every check, each against the reference code path it replaces */
+static std::vector<Check> checks()
+{
+    std::vector<Check> result;
+
+    // Vector advect against the scalar loop, at every level this machine
+    // has, on a size that leaves a partial vector at the end of each row
+    for (int level = Simd_SSE; level <= detect_simd_level(); ++level) {
+        for (int N : { 100, 128 }) {
+            Simd_Level simd = (Simd_Level) level;
+            result.push_back({ std::string("simd ") + simd_level_name(simd)
+                    + " vs scalar", N,
+                [](Fluid_Sim& sim) { sim.simd_ = Simd_Scalar; },
+                [simd](Fluid_Sim& sim) { sim.simd_ = simd; } });
+        }
+    }
+
+    // Kernels built for N against the generic ones, in every order
+    const Relaxation_Order orders[] = { Lexicographic, Red_Black,
+        Red_Black_Wavefront };
+    const char* order_names[] = { "lex", "rb", "wavefront" };
+    for (int o = 0; o < 3; ++o) {
+        for (int N : { 128, 256 }) {
+            Relaxation_Order order = orders[o];
+            result.push_back({ std::string("fixed size vs generic, ")
+                    + order_names[o], N,
+                [order](Fluid_Sim& sim) {
+                    sim.relaxation_ = order;
+                    sim.fixed_size_kernels_ = false;
+                },
+                [order](Fluid_Sim& sim) { sim.relaxation_ = order; } });
+        }
+    }
+
+    // Sleeping tiles that are exactly zero against the dense sweeps
+    for (int N : { 100, 256 }) {
+        result.push_back({ "tiles at threshold 0 vs dense", N,
+            [](Fluid_Sim& sim) { sim.relaxation_ = Red_Black; },
+            [](Fluid_Sim& sim) {
+                sim.relaxation_ = Red_Black;
+                sim.sleep_tiles_ = true;
+                sim.tile_threshold_ = 0.0f;
+            } });
+    }
+
+    // Several red-black sweeps per pass against one sweep per pass, both
+    // for a fixed number of sweeps and stopping at a tolerance
+    for (float tolerance : { -1.0f, 1e-4f }) {
+        for (int depth : { 1, 2, 4, 7 }) {
+            for (int N : { 100, 128 }) {
+                std::function<void(Fluid_Sim&)> red_black =
+                        [tolerance](Fluid_Sim& sim) {
+                    sim.relaxation_ = Red_Black;
+                    sim.viscosity_control_.tolerance = tolerance;
+                    sim.density_control_.tolerance = tolerance;
+                    sim.pressure_control_.tolerance = tolerance;
+                };
+                result.push_back({ "wavefront depth " + std::to_string(depth)
+                        + (tolerance < 0.0f ? " vs rb, fixed" : " vs rb"), N,
+                    red_black,
+                    [red_black, depth](Fluid_Sim& sim) {
+                        red_black(sim);
+                        sim.relaxation_ = Red_Black_Wavefront;
+                        sim.wavefront_depth_ = depth;
+                    } });
+            }
+        }
+    }
+
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    int steps = 40;
+    std::string filter;
+
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        bool has_value = a + 1 < argc;
+        if (arg == "-steps" && has_value) {
+            steps = std::atoi(argv[++a]);
+        } else if (arg == "-check" && has_value) {
+            filter = argv[++a];
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int failed = 0, run = 0;
+    for (const Check& check : checks()) {
+        if (check.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        ++run;
+        if (!run_check(check, steps)) {
+            ++failed;
+        }
+    }
+    printf("%d of %d checks failed\n", failed, run);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
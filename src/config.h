@@ -7,11 +7,11 @@ namespace config
     static float diffusion = 0.0f; // 0.00001f; // density diffusion rate
     static float time_step = 0.125f;
 
-    static void increment_time_step() { time_step *= 2; }
-    static void decrement_time_step() { time_step /= 2; }
-    static void increase_resolution() { N += 50; }
-    static void decrease_resolution() { N -= 50; }
-    static void increase_viscosity() { viscosity *= 2; }
-    static void decrease_viscosity() { viscosity /= 2; }
+    static inline void increment_time_step() { time_step *= 2; }
+    static inline void decrement_time_step() { time_step /= 2; }
+    static inline void increase_resolution() { N += 50; }
+    static inline void decrease_resolution() { N -= 50; }
+    static inline void increase_viscosity() { viscosity *= 2; }
+    static inline void decrease_viscosity() { viscosity /= 2; }
 }
 #endif // CONFIG_H
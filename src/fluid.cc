@@ -1,65 +1,300 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <vector>
 #include "fluid.h"
 #include "heat.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 Fluid_Sim::Fluid_Sim (int N, float viscosity, float diffusion, float time_step)
    : N_(N), diffusion_(diffusion), time_step_(time_step),
-     enable_gravity_(false), enable_heat_(false),
-     x(N, X_Velocity), x_old(N, X_Velocity), 
-     y(N, Y_Velocity), y_old(N, Y_Velocity), 
-     density(N, Density), density_old(N, Density),
-     viscosity_grid(N), levelset(N) 
+     adaptive_(false), cfl_(2.0f), max_substeps_(8), max_velocity_(0.0f),
+     enable_gravity_(false), enable_heat_(false), relaxation_(Lexicographic),
+     wavefront_depth_(4), fuse_viscosity_(true), projection_(Gauss_Seidel_Projection), warm_start_(true),
+     simd_(detect_simd_level()), fixed_size_kernels_(true), task_graph_(false), sleep_tiles_(false), tile_threshold_(1e-6f),
+     viscosity_(viscosity), viscosity_dirty_(true), coefficient_time_step_(0.0f),
+     coefficient_N_(0), viscosity_peak_(0.0f),
+     x(arena_, X_Velocity), x_old(arena_, X_Velocity),
+     y(arena_, Y_Velocity), y_old(arena_, Y_Velocity),
+     density(arena_, Density), density_old(arena_, Density),
+     viscosity_grid(arena_), viscosity_coefficient(arena_),
+     pressure(arena_), pressure_advect(arena_),
+     x_source(arena_), y_source(arena_), density_source(arena_),
+     levelset(N)
 {
+    arena_.layout(N);
+    x_source.resize(N);
+    y_source.resize(N);
+    density_source.resize(N);
     viscosity_grid.set_all(viscosity);
+    Solver_Control control = { 1e-3f, 30 };
+    viscosity_control_ = density_control_ = pressure_control_ = control;
+    memset(&stats_, 0, sizeof(stats_));
 
 }
 
 void Fluid_Sim::simulation_step()
 {
+    apply_injections();
+    stats_.tiles_awake = stats_.tiles_total = 0;
+    stats_.substeps = 1;
+    integrate();
+    clear_sources();
+}
+
+int Fluid_Sim::advance_frame()
+{
+    if (!adaptive_) {
+        simulation_step();
+        return 1;
+    }
+
+    apply_injections();
+    stats_.tiles_awake = stats_.tiles_total = 0;
+    float frame = time_step_;
+    float remaining = frame;
+    int substeps = 0;
+    while (remaining > 0.0f) {
+        float dt = remaining;
+        if (++substeps < max_substeps_ && max_velocity_ > 0.0f) {
+            // Semi-Lagrangian advection stays stable past a CFL number of
+            // one, but accuracy drops with every cell a backtrace crosses
+            float stable = cfl_ / (max_velocity_ * N_);
+            if (stable < remaining) {
+                // Even steps rather than a sliver at the end of the frame
+                dt = remaining / std::ceil(remaining / stable);
+            }
+        }
+        time_step_ = dt;
+        integrate();
+        remaining -= dt;
+    }
+    time_step_ = frame;
+    clear_sources();
+    stats_.substeps = substeps;
+    return substeps;
+}
+
+void Fluid_Sim::integrate()
+{
+    Task_Graph& graph = step_graph_;
+    graph.clear();
+
     // --------- Velocity Solver --------- //
-    // Assuming external forces currently stored in x_old and y_old
-    add_external_forces(x, x_old);
-    add_external_forces(y, y_old);
-     
-    // Adding gravitational force
-    if (enable_gravity_) {
-        add_gravity(x);
-    }
-
-    swap(x, x_old); swap(y, y_old);
-
-    // Viscous heat diffusion
-    x.type_ = None;
-    y.type_ = None;
-    if (enable_heat_) {
-        heat_boundary_.apply_heat(viscosity_grid);
-    } 
-    diffuse_viscosity(x, x_old, viscosity_grid);
-    diffuse_viscosity(y, y_old, viscosity_grid);
-    x.type_ = X_Velocity;
-    y.type_ = Y_Velocity;
+    int forces_x = graph.add("forces x", [this]() {
+        add_external_forces(x, x_source);
+        // Adding gravitational force
+        if (enable_gravity_) {
+            add_gravity(x);
+        }
+        swap(x, x_old);
+    });
+    int forces_y = graph.add("forces y", [this]() {
+        add_external_forces(y, y_source);
+        swap(y, y_old);
+    });
+
+    // Viscous heat diffusion. Like all gauss seidel solves it mirrors the
+    // velocity at the walls as a scalar, not as X_ and Y_Velocity.
+    int heat = graph.add("heat", [this]() {
+        if (enable_heat_ && heat_boundary_.apply_heat(viscosity_grid)) {
+            viscosity_dirty_ = true;
+        }
+        viscosity_coefficients();
+    });
+
+    // Whether the fluid is viscous is only known once heat has run
+    std::vector<int> viscous;
+    if (fuse_viscosity_) {
+        viscous.push_back(graph.add("viscosity x+y", [this]() {
+            if (viscosity_peak_ > 0.0f) {
+                stats_.viscosity[0] = stats_.viscosity[1]
+                    = diffuse_viscosity(x, x_old, y, y_old);
+            } else {
+                viscous_copy(x, x_old, stats_.viscosity[0]);
+                viscous_copy(y, y_old, stats_.viscosity[1]);
+            }
+        }));
+        graph.depend(viscous[0], forces_x);
+        graph.depend(viscous[0], forces_y);
+    } else {
+        viscous.push_back(graph.add("viscosity x", [this]() {
+            viscous_solve(x, x_old, stats_.viscosity[0]);
+        }));
+        viscous.push_back(graph.add("viscosity y", [this]() {
+            viscous_solve(y, y_old, stats_.viscosity[1]);
+        }));
+        graph.depend(viscous[0], forces_x);
+        graph.depend(viscous[1], forces_y);
+        if (sleep_tiles_) {
+            // Both measure into field_tiles_
+            graph.depend(viscous[1], viscous[0]);
+        }
+    }
+    for (size_t k = 0; k < viscous.size(); ++k) {
+        graph.depend(viscous[k], heat);
+    }
 
+    // --------- Density Solver --------- //
+    // Independent of the velocity until it is advected
+    int diffuse_density = graph.add("diffuse density", [this]() {
+        add_external_forces(density, density_source);
+        if (diffusion_ > 0.0f) {
+            swap(density, density_old);
+            stats_.density = diffuse(density, density_old, diffusion_);
+            swap(density, density_old);
+        } else {
+            // Same shortcut as for an inviscid fluid
+            adjust_bounds(density);
+            swap(density, density_old);
+            Solver_Stats none = { 0, 0.0f };
+            stats_.density = none;
+        }
+    });
+    if (sleep_tiles_) {
+        // Tile maps and the tile counts of stats_ are shared by every
+        // diffuse and advect, keep them one at a time
+        for (size_t k = 0; k < viscous.size(); ++k) {
+            graph.depend(diffuse_density, viscous[k]);
+        }
+    }
     // Enforce incompressibility
-    project(x, y, x_old, y_old);
-    swap(x, x_old); swap(y, y_old);
-   
+    int project_diffused = graph.add("project", [this]() {
+        stats_.pressure[0] = project(x, y, pressure, x_old);
+        swap(x, x_old); swap(y, y_old);
+    });
+    for (size_t k = 0; k < viscous.size(); ++k) {
+        graph.depend(project_diffused, viscous[k]);
+    }
+
     // Self-Advection -- aka move velocity field along the velocity field
-    advect(x, x_old, x_old, y_old);
-    advect(y, y_old, x_old, y_old);
+    int advect_x = graph.add("advect x", [this]() {
+        advect(x, x_old, x_old, y_old, true);
+    });
+    int advect_y = graph.add("advect y", [this]() {
+        advect(y, y_old, x_old, y_old, true);
+    });
+    graph.depend(advect_x, project_diffused);
+    graph.depend(advect_y, project_diffused);
+    if (sleep_tiles_) {
+        // Both build advect_tiles_
+        graph.depend(advect_x, diffuse_density);
+        graph.depend(advect_y, advect_x);
+    }
 
     // Enforce incompressibility, again
-    project(x, y, x_old, y_old);
+    int project_advected = graph.add("project again", [this]() {
+        stats_.pressure[1] = project(x, y, pressure_advect, x_old);
+    });
+    graph.depend(project_advected, advect_x);
+    graph.depend(project_advected, advect_y);
 
-    // --------- Density Solver --------- //
-    add_external_forces(density, density_old);
-    swap(density, density_old);
-    diffuse(density, density_old, diffusion_);
-    swap(density, density_old);
-    advect(density, density_old, x, y);
+    // The liquid surface moves with the final velocity, like the density
+    int advect_liquid = graph.add("advect liquid", [this]() {
+        levelset.advect(x, y, time_step_ * N_, max_velocity_);
+    });
+    graph.depend(advect_liquid, project_advected);
 
-    density_old.reset();
-    x_old.reset();
-    y_old.reset();
+    // --------- Density Advection --------- //
+    int advect_density = graph.add("advect density", [this]() {
+        advect(density, density_old, x, y, true);
+    });
+    graph.depend(advect_density, project_advected);
+    graph.depend(advect_density, diffuse_density);
+
+    graph.run(task_graph_);
+}
+
+void Fluid_Sim::viscous_solve(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
+        Solver_Stats& stats)
+{
+    if (viscosity_peak_ > 0.0f) {
+        stats = diffuse_viscosity(grid, grid_prev);
+    } else {
+        viscous_copy(grid, grid_prev, stats);
+    }
+}
+
+void Fluid_Sim::viscous_copy(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
+        Solver_Stats& stats)
+{
+    // The solve would only copy grid_prev, bounds and all
+    swap(grid, grid_prev);
+    Bounds<None>::apply(grid);
+    Solver_Stats none = { 0, 0.0f };
+    stats = none;
+}
+
+void Fluid_Sim::apply_injections()
+{
+    double now = Injection::now();
+    double oldest = now;
+    stats_.injections = (int) injections_.drain([&](const Injection& event) {
+        oldest = std::min(oldest, event.time_);
+        int i = std::min(std::max(event.i_, 1), N_);
+        int j = std::min(std::max(event.j_, 1), N_);
+        switch (event.type_) {
+            case Velocity_Impulse:
+                x_source.set(i, j, event.x_);
+                y_source.set(i, j, event.y_);
+                break;
+            case Dye_Splat:
+                // Same block the viewer's brush always painted
+                for (int x = std::max(i - event.radius_, 0);
+                        x < std::min(i + event.radius_, N_); ++x) {
+                    for (int y = std::max(j - event.radius_, 0);
+                            y < std::min(j + event.radius_, N_); ++y) {
+                        density_source.set(x, y, event.amount_);
+                    }
+                }
+                break;
+            case Viscosity_Change:
+                set_viscosity(event.amount_);
+                break;
+        }
+    });
+    stats_.injection_latency = (float) (now - oldest);
+}
+
+void Fluid_Sim::set_viscosity(float viscosity)
+{
+    viscosity_ = viscosity;
+    viscosity_grid.set_all(viscosity_);
+    viscosity_dirty_ = true;
+}
+
+bool Fluid_Sim::viscosity_coefficients()
+{
+    if (!viscosity_dirty_ && coefficient_time_step_ == time_step_
+            && coefficient_N_ == N_) {
+        return viscosity_peak_ > 0.0f;
+    }
+
+    // Same expression the solver used to evaluate per cell and sweep
+    float peak = parallel_max<float>(1, N_ + 1, [&](int j) {
+        float row_peak = 0.0f;
+        for (int i = 1; i <= N_; ++i) {
+            float a = time_step_ * viscosity_grid(i, j) * N_ * N_;
+            viscosity_coefficient(i, j) = a;
+            row_peak = std::max(row_peak, a);
+        }
+        return row_peak;
+    });
+    viscosity_dirty_ = false;
+    coefficient_time_step_ = time_step_;
+    coefficient_N_ = N_;
+    viscosity_peak_ = peak;
+    return peak > 0.0f;
+}
+
+void Fluid_Sim::clear_sources()
+{
+    x_source.clear();
+    y_source.clear();
+    density_source.clear();
 }
 
 void Fluid_Sim::reset() 
@@ -70,134 +305,750 @@ void Fluid_Sim::reset()
     y_old.reset();
     density.reset();
     density_old.reset();
+    pressure.reset();
+    pressure_advect.reset();
+    clear_sources();
+    max_velocity_ = 0.0f;
 }
 
 void Fluid_Sim::resize(int N) 
 {
     N_ = N;
-    x.resize(N);
-    x_old.resize(N);
-    y.resize(N);
-    y_old.resize(N);
-    density.resize(N);
-    density_old.resize(N);
+    // Reuses the arena's block whenever the new grids fit in it
+    arena_.layout(N);
+    x_source.resize(N);
+    y_source.resize(N);
+    density_source.resize(N);
+    levelset.resize(N);
+    set_viscosity(viscosity_);
+    max_velocity_ = 0.0f;
 }
 
 void Fluid_Sim::add_external_forces(Fluid_Grid<float>& target,
-        Fluid_Grid<float>& source)
+        const Source_Grid& sources)
 {
-    for (int i = 0; i < (N_+2)*(N_+2); ++i) {
-        //TODO ---- DONT ADD IF NOT LIQUID DUMMY
-        target.array_[i] += source.array_[i] * time_step_;  
-    }   
+    //TODO ---- DONT ADD IF NOT LIQUID DUMMY
+    sources.add(target, time_step_);
 }
  
 void Fluid_Sim::add_gravity(Fluid_Grid<float>& y) {
 	float amount = -9.8f * time_step_;
     // ALSO ADD GRAVITY ON CELLS DIRECTLY ABOVE
     // AKA IF CELL HAS A DUDE BELOW IT THAT IS IN LIQUID, THEN LET GRAVITY DO SHIT
-    for (int i = 1; i <= N_; ++i) {
-        for (int j = 1; j <= N_; ++j) {
-            if (levelset.is_liquid(i, j)) {
-                y(i, j) += amount;
+    levelset.for_each_liquid([&](int i, int j) {
+        y(i, j) += amount;
+    });
+}
+
+
+void Fluid_Sim::adjust_bounds(Fluid_Grid<float>& grid)
+{
+    apply_bounds(grid, grid.type_);
+}
+
+int Fluid_Sim::kernel_size() const
+{
+    bool built = N_ == 128 || N_ == 256 || N_ == 512 || N_ == 1024;
+    if (!fixed_size_kernels_ || !built
+            || x.stride_ != Fluid_Grid<float>::padded_stride(N_)) {
+        return 0;
+    }
+    return N_;
+}
+
+/**
+ * Body of a solver entry point: return call<Size> args for the Size
+ * kernel_size() picks, the generic call<0> args otherwise. Every size
+ * listed here is compiled into each kernel the macro dispatches to.
+ */
+#define DISPATCH_SIZE(call, args) \
+    switch (kernel_size()) { \
+    case 128:  return call<128> args; \
+    case 256:  return call<256> args; \
+    case 512:  return call<512> args; \
+    case 1024: return call<1024> args; \
+    default:   return call<0> args; \
+    }
+ 
+namespace {
+
+/** Zero the ghost cells, the boundary of an all-zero initial guess */
+void zero_bounds(Fluid_Grid<float>& grid)
+{
+    int N = grid.N_;
+    for (int k = 0; k <= N + 1; ++k) {
+        grid(0, k) = grid(N+1, k) = 0.0f;
+        grid(k, 0) = grid(k, N+1) = 0.0f;
+    }
+}
+
+} // namespace
+
+/**
+ * Temporal blocking of the red-black sweeps. A pass over the grid runs
+ * wavefront_depth_ sweeps, i.e. twice as many colour updates, as a wavefront
+ * of rows: colour update h of the pass works on row t - 2h + 1 at time t.
+ * It trails update h-1 by two rows, so the rows it reads are already final
+ * for h-1 and not yet touched by h+1. The updates in flight at a time never
+ * share a row and run in parallel, and a row is reused by all of them while
+ * it is still in cache instead of being streamed from memory once per sweep.
+ * Each row is further cut into column chunks, enough for every thread of
+ * the team to have a chunk of some row at each time; the cells of a colour
+ * in a row only read the other colour, so the chunks are independent.
+ *
+ * A chunk's ghost cells only mirror that chunk, so they are refreshed as
+ * soon as the second colour of a sweep is done with it.
+ *
+ * The residual of every sweep is known only once the pass is over. So that
+ * the solve stops at the same sweep as the Red_Black order does, a pass
+ * with a tolerance to meet saves each row as its first update reaches it.
+ * When the tolerance was met before the last sweep of the pass, the grids
+ * are put back and the pass runs again up to that sweep. The result
+ * matches the Red_Black order bit for bit.
+ */
+template <int Size, typename Boundary, typename Relax>
+Solver_Stats Fluid_Sim::relax_wavefront(Fluid_Grid<float>& grid,
+        Fluid_Grid<float>* other, float scale, const Solver_Control& control,
+        bool zero_guess, Relax relax)
+{
+    Solver_Stats stats;
+    stats.iterations = 0;
+    stats.residual = 0.0f;
+    const int N = Size ? Size : N_;
+    const int width = N + 2;
+    int depth = std::max(1, wavefront_depth_);
+    if (zero_guess) {
+        zero_bounds(grid);
+        if (other) {
+            zero_bounds(*other);
+        }
+    }
+
+    // Chunks of at least Wavefront_Chunk cells, as many as the team needs
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    int chunks = std::max(1, std::min((threads + 2 * depth - 1) / (2 * depth),
+                N / Wavefront_Chunk));
+    // Largest change per colour update and chunk of the last pass, and the
+    // grids as they were at its start. The scratch is the solve's own, as
+    // stages of a task graph run their solves side by side.
+    std::vector<float> change;
+    std::vector<float> save_grid[2];
+    Fluid_Grid<float>* grids[2] = { &grid, other };
+    int count = other ? 2 : 1;
+    bool exact = control.tolerance >= 0.0f;
+    if (exact) {
+        for (int g = 0; g < count; ++g) {
+            save_grid[g].resize((size_t) width * width);
+        }
+    }
+
+    // Sweeps first_sweep to first_sweep + sweeps - 1 as one pass, saving
+    // the rows it changes when save is set
+    auto pass = [&](int first_sweep, int sweeps, bool save) {
+        int updates = 2 * sweeps;
+        change.assign((size_t) updates * chunks, 0.0f);
+        if (save) {
+            // Only the row next to them writes the ghost rows
+            for (int g = 0; g < count; ++g) {
+                float* copy = save_grid[g].data();
+                std::copy(&(*grids[g])(0, 0), &(*grids[g])(0, 0) + width, copy);
+                std::copy(&(*grids[g])(0, N + 1), &(*grids[g])(0, N + 1) + width,
+                        copy + (size_t) width * (N + 1));
+            }
+        }
+
+        for (int t = 0; t < N + 2 * (updates - 1); ++t) {
+            // Each loop waits for all its iterations, which keeps the
+            // wavefront in step
+            parallel_for(0, updates * chunks, [&](int k) {
+                int h = k / chunks, c = k % chunks;
+                int j = t - 2 * h + 1;
+                if (j < 1 || j > N) {
+                    return;
+                }
+                int i0 = 1 + c * N / chunks, i1 = (c + 1) * N / chunks;
+                if (save && h == 0) {
+                    int lo = (c == 0) ? 0 : i0;
+                    int hi = (c == chunks - 1) ? N + 1 : i1;
+                    for (int g = 0; g < count; ++g) {
+                        std::copy(&(*grids[g])(lo, j), &(*grids[g])(hi, j) + 1,
+                                save_grid[g].data() + lo + (size_t) width * j);
+                    }
+                }
+                int color = h & 1;
+                int sweep = first_sweep + h / 2;
+                bool fresh = zero_guess && sweep == 0;
+                bool isolated = fresh && color == 0;
+                float row_change = 0.0f;
+                int first = 1 + ((j + 1 + color) & 1);
+                for (int i = i0 + ((i0 - first) & 1); i <= i1; i += 2) {
+                    row_change = std::max(row_change, relax(i, j, fresh, isolated));
+                }
+                change[k] = std::max(change[k], row_change);
+                if (color == 1) {
+                    Boundary::region(grid, i0, i1, j, j);
+                    if (other) {
+                        Boundary::region(*other, i0, i1, j, j);
+                    }
+                }
+            });
+        }
+    };
+
+    // Residual of sweep s of the last pass
+    auto residual = [&](int s) {
+        float r = 0.0f;
+        for (int k = 2 * s * chunks; k < (2 * s + 2) * chunks; ++k) {
+            r = std::max(r, change[k]);
+        }
+        return r * scale;
+    };
+
+    // A pass is thousands of short loops, all of them on one team
+    with_team([&]() {
+        while (stats.iterations < control.max_iterations) {
+            int sweeps = std::min(depth, control.max_iterations - stats.iterations);
+            pass(stats.iterations, sweeps, exact);
+
+            int met = sweeps - 1;
+            for (int s = 0; s < sweeps; ++s) {
+                if (residual(s) <= control.tolerance) {
+                    met = s;
+                    break;
+                }
+            }
+            if (met < sweeps - 1) {
+                // Back to the start of the pass, and only as far as sweep met
+                for (int g = 0; g < count; ++g) {
+                    const float* copy = save_grid[g].data();
+                    parallel_for(0, N + 2, [&](int j) {
+                        std::copy(copy + (size_t) width * j,
+                                copy + (size_t) width * (j + 1), &(*grids[g])(0, j));
+                    });
+                }
+                pass(stats.iterations, met + 1, false);
+            }
+            stats.iterations += met + 1;
+            stats.residual = residual(met);
+            if (stats.residual <= control.tolerance) {
+                break;
+            }
+        }
+    });
+    return stats;
+}
+
+/**
+ * Red-black sweeps that only visit the active tiles, in parallel over the
+ * tiles of a colour. Inactive tiles are set to zero once up front and stay
+ * that way, so cells on the edge of the active region read zero across it.
+ * Edge tiles refresh the ghost cells next to them as they finish a sweep,
+ * the inactive ones once at the end. With every tile active the result
+ * matches the Red_Black order bit for bit.
+ */
+template <typename Boundary, typename Relax>
+Solver_Stats Fluid_Sim::relax_tiles(Fluid_Grid<float>& grid,
+        Fluid_Grid<float>* other, float scale, const Solver_Control& control,
+        bool zero_guess, const Tile_Map& tiles, Relax relax)
+{
+    Solver_Stats stats;
+    stats.iterations = 0;
+    stats.residual = 0.0f;
+    tiles.zero_inactive(grid);
+    if (other) {
+        tiles.zero_inactive(*other);
+    }
+    if (zero_guess) {
+        zero_bounds(grid);
+        if (other) {
+            zero_bounds(*other);
+        }
+    }
+
+    std::vector<int> active;
+    for (int t = 0; t < tiles.tiles_ * tiles.tiles_; ++t) {
+        if (tiles.active_[t]) {
+            active.push_back(t);
+        }
+    }
+    int count = (int) active.size();
+
+    // Sweeps of small tiles are short loops, all of them on one team
+    with_team([&]() {
+        for (int step = 0; step < control.max_iterations; ++step) {
+            float change = 0.0f;
+            bool fresh = zero_guess && step == 0;
+            for (int color = 0; color < 2; ++color) {
+                bool isolated = fresh && color == 0;
+                change = std::max(change, parallel_max<float>(0, count, [&](int k) {
+                    int tx = active[k] % tiles.tiles_;
+                    int ty = active[k] / tiles.tiles_;
+                    int i0 = tiles.first(tx), i1 = tiles.last(tx);
+                    int j0 = tiles.first(ty), j1 = tiles.last(ty);
+                    float tile_change = 0.0f;
+                    for (int j = j0; j <= j1; ++j) {
+                        for (int i = i0 + ((i0 + j + color) & 1); i <= i1; i += 2) {
+                            tile_change = std::max(tile_change,
+                                    relax(i, j, fresh, isolated));
+                        }
+                    }
+                    if (color == 1) {
+                        Boundary::region(grid, i0, i1, j0, j1);
+                        if (other) {
+                            Boundary::region(*other, i0, i1, j0, j1);
+                        }
+                    }
+                    return tile_change;
+                }));
+            }
+            stats.iterations = step + 1;
+            stats.residual = change * scale;
+            if (stats.residual <= control.tolerance) {
+                break;
+            }
+        }
+    });
+
+    // The inactive tiles stayed zero throughout, mirror them just once
+    if (stats.iterations > 0) {
+        for (int ty = 0; ty < tiles.tiles_; ++ty) {
+            for (int tx = 0; tx < tiles.tiles_; ++tx) {
+                if (tiles.active(tx, ty)) {
+                    continue;
+                }
+                int i0 = tiles.first(tx), i1 = tiles.last(tx);
+                int j0 = tiles.first(ty), j1 = tiles.last(ty);
+                Boundary::region(grid, i0, i1, j0, j1);
+                if (other) {
+                    Boundary::region(*other, i0, i1, j0, j1);
+                }
             }
         }
     }
+    return stats;
 }
 
+/**
+ * The Red_Black order: a cell only depends on cells of the other colour,
+ * so each colour can be updated in parallel. The second colour refreshes
+ * the ghost cells of each row as it finishes it.
+ */
+template <int Size, typename Boundary, typename Relax>
+Solver_Stats Fluid_Sim::relax_red_black(Fluid_Grid<float>& grid,
+        Fluid_Grid<float>* other, float scale, const Solver_Control& control,
+        bool zero_guess, Relax relax)
+{
+    Solver_Stats stats;
+    stats.iterations = 0;
+    stats.residual = 0.0f;
+    const int N = Size ? Size : N_;
+    if (zero_guess) {
+        zero_bounds(grid);
+        if (other) {
+            zero_bounds(*other);
+        }
+    }
 
-void Fluid_Sim::adjust_bounds(Fluid_Grid<float>& grid)
+    for (int step = 0; step < control.max_iterations; ++step) {
+        float change = 0.0f;
+        bool fresh = zero_guess && step == 0;
+        for (int color = 0; color < 2; ++color) {
+            bool isolated = fresh && color == 0;
+            change = std::max(change, parallel_max<float>(1, N + 1, [&](int j) {
+                float row_change = 0.0f;
+                int i = 1 + ((j + 1 + color) & 1);
+                // Constant flags in the common case let relax drop its
+                // zero guess selects
+                if (!fresh) {
+                    for (; i <= N; i += 2) {
+                        row_change = std::max(row_change, relax(i, j, false, false));
+                    }
+                } else {
+                    for (; i <= N; i += 2) {
+                        row_change = std::max(row_change, relax(i, j, true, isolated));
+                    }
+                }
+                if (color == 1) {
+                    Boundary::row(grid, j);
+                    if (other) {
+                        Boundary::row(*other, j);
+                    }
+                }
+                return row_change;
+            }));
+        }
+        stats.iterations = step + 1;
+        stats.residual = change * scale;
+        if (stats.residual <= control.tolerance) {
+            break;
+        }
+    }
+    return stats;
+}
+
+const Tile_Map* Fluid_Sim::diffusion_tiles(Fluid_Grid<float>& rhs, float a,
+        const Solver_Control& control, Fluid_Grid<float>* rhs_other)
 {
-    // Handling edges
-    for (int i = 1; i <= N_; ++i) {
-        grid(0,    i) = (grid.type_ == X_Velocity) ? -grid(1, i)  : grid(1,  i); 
-        grid(N_+1, i) = (grid.type_ == X_Velocity) ? -grid(N_, i) : grid(N_, i); 
-        grid(i,    0) = (grid.type_ == Y_Velocity) ? -grid(i, 1)  : grid(i,  1); 
-        grid(i, N_+1) = (grid.type_ == Y_Velocity) ? -grid(i, N_) : grid(i, N_); 
+    field_tiles_.measure(rhs);
+    if (rhs_other) {
+        pair_tiles_.measure(*rhs_other);
+        field_tiles_.merge(pair_tiles_);
+    }
+    float peak = field_tiles_.peak();
+
+    // Summing the Jacobi series, a source's influence shrinks by at least
+    // 4a / c per cell of distance. Independently, a red-black sweep from a
+    // zero guess carries it no more than two cells.
+    float reach = 0.0f;
+    if (peak > tile_threshold_ && a > 0.0f) {
+        reach = 2.0f * control.max_iterations;
+        if (tile_threshold_ > 0.0f) {
+            reach = std::min(reach, std::log(peak / tile_threshold_)
+                    / std::log1p(1.0f / (4.0f * a)));
+        }
     }
+    int cells = (int) std::ceil(reach);
 
-    // Handling corners -- average out the two nearest
-    grid(0,       0) = 0.5 * (grid(1,     0) + grid(0,     1));
-    grid(0,    N_+1) = 0.5 * (grid(1,  N_+1) + grid(0,    N_));
-    grid(N_+1,    0) = 0.5 * (grid(N_,    0) + grid(N_+1,  1));
-    grid(N_+1, N_+1) = 0.5 * (grid(N_, N_+1) + grid(N_+1, N_));
+    stats_.tiles_awake += field_tiles_.dilate(tile_threshold_,
+            (cells + Tile_Size - 1) / Tile_Size);
+    stats_.tiles_total += field_tiles_.tiles_ * field_tiles_.tiles_;
+    return &field_tiles_;
 }
- 
-void Fluid_Sim::gauss_seidel(Fluid_Grid<float>& grid, 
-        Fluid_Grid<float>& grid_prev, float a, float c)
+
+template <int Size>
+Solver_Stats Fluid_Sim::gauss_seidel_fixed(Fluid_Grid<float>& grid,
+        Fluid_Grid<float>& grid_prev, float a, float c,
+        const Solver_Control& control, bool zero_guess, const Tile_Map* tiles)
 {
-    // _Pragma("omp parallel for")
-    for (int step = 0; step < solver_steps; ++step) {
-        for (int i = 1; i <= N_; ++i) {
-            for (int j = 1; j <= N_; ++j) {
-                grid(i, j) = (grid_prev(i,j) + a * (grid(i-1,j) + grid(i+1,j) 
-                        + grid(i,j-1) + grid(i,j+1))) / c;
+    // The residual of a cell just before its update is c times the change
+    // the update makes, so convergence is tracked as a side effect of the
+    // sweep. It is taken relative to the right hand side.
+    //
+    // With zero_guess the first sweep reads cells it has not updated yet,
+    // and their neighbours, as zero. Only the ghost cells are cleared.
+    Solver_Stats stats;
+    stats.iterations = 0;
+    stats.residual = 0.0f;
+    float rhs_norm = tiles ? tiles->peak() : max_norm(grid_prev);
+    float scale = c / (rhs_norm > 0.0f ? rhs_norm : 1.0f);
+    float change = 0.0f;
+    if (zero_guess) {
+        zero_bounds(grid);
+    }
+    const int N = Size ? Size : N_;
+    Grid_View<float, Size> cells(grid), rhs(grid_prev);
+
+    auto relax = [&](int i, int j, bool fresh, bool isolated) {
+        float old = fresh ? 0.0f : cells(i, j);
+        float sum = isolated ? 0.0f : cells(i-1,j) + cells(i+1,j)
+                + cells(i,j-1) + cells(i,j+1);
+        float value = (rhs(i,j) + a * sum) / c;
+        cells(i, j) = value;
+        return std::fabs(value - old);
+    };
+    if (tiles) {
+        return relax_tiles<Bounds<None> >(grid, 0, scale, control, zero_guess, *tiles, relax);
+    }
+    if (relaxation_ == Red_Black_Wavefront) {
+        return relax_wavefront<Size, Bounds<None> >(grid, 0, scale, control, zero_guess, relax);
+    }
+
+    if (relaxation_ == Red_Black) {
+        return relax_red_black<Size, Bounds<None> >(grid, 0, scale, control, zero_guess, relax);
+    }
+
+    for (int step = 0; step < control.max_iterations; ++step) {
+        change = 0.0f;
+        // Cells after (i, j) in sweep order still hold the guess
+        bool fresh = zero_guess && step == 0;
+        for (int i = 1; i <= N; ++i) {
+            for (int j = 1; j <= N; ++j) {
+                float old = fresh ? 0.0f : cells(i, j);
+                float sum = fresh ? cells(i-1,j) + cells(i,j-1)
+                        : cells(i-1,j) + cells(i+1,j) + cells(i,j-1) + cells(i,j+1);
+                float value = (rhs(i,j) + a * sum) / c;
+                change = std::max(change, std::fabs(value - old));
+                cells(i, j) = value;
             }
+            // Column i is final for this sweep
+            Bounds<None>::column(grid, i);
+        }
+        stats.iterations = step + 1;
+        stats.residual = change * scale;
+        if (stats.residual <= control.tolerance) {
+            break;
         }
-        // Adjust the boundaries of the array after changing values
-        adjust_bounds(grid);
     }
+    return stats;
 }
- 
-void Fluid_Sim::gauss_seidel_viscosity(Fluid_Grid<float>& grid, 
-        Fluid_Grid<float>& grid_prev, Fluid_Grid<float>& viscosity)
+
+Solver_Stats Fluid_Sim::gauss_seidel(Fluid_Grid<float>& grid,
+        Fluid_Grid<float>& grid_prev, float a, float c,
+        const Solver_Control& control, bool zero_guess, const Tile_Map* tiles)
 {
-    // _Pragma("omp parallel for")
-    for (int step = 0; step < solver_steps; ++step) {
-        for (int i = 1; i <= N_; ++i) {
-            for (int j = 1; j <= N_; ++j) {
-                float a = time_step_ * viscosity(i, j) * N_ * N_;
+    DISPATCH_SIZE(gauss_seidel_fixed, (grid, grid_prev, a, c, control, zero_guess, tiles));
+}
+
+template <int Size>
+Solver_Stats Fluid_Sim::gauss_seidel_viscosity_fixed(Fluid_Grid<float>& grid,
+        Fluid_Grid<float>& grid_prev, bool zero_guess, const Tile_Map* tiles)
+{
+    // Same residual tracking as gauss_seidel, with the per-cell c folded in
+    const Solver_Control& control = viscosity_control_;
+    viscosity_coefficients();
+    Solver_Stats stats;
+    stats.iterations = 0;
+    stats.residual = 0.0f;
+    float rhs_norm = tiles ? tiles->peak() : max_norm(grid_prev);
+    float scale = 1.0f / (rhs_norm > 0.0f ? rhs_norm : 1.0f);
+    float change = 0.0f;
+    if (zero_guess) {
+        zero_bounds(grid);
+    }
+    const int N = Size ? Size : N_;
+    Grid_View<float, Size> cells(grid), rhs(grid_prev),
+            coefficients(viscosity_coefficient);
+
+    auto relax = [&](int i, int j, bool fresh, bool isolated) {
+        float a = coefficients(i, j);
+        float c = 1 + 4 * a;
+        float old = fresh ? 0.0f : cells(i, j);
+        float sum = isolated ? 0.0f : cells(i-1,j) + cells(i+1,j)
+                + cells(i,j-1) + cells(i,j+1);
+        float value = (rhs(i,j) + a * sum) / c;
+        cells(i, j) = value;
+        return c * std::fabs(value - old);
+    };
+    if (tiles) {
+        return relax_tiles<Bounds<None> >(grid, 0, scale, control, zero_guess, *tiles, relax);
+    }
+    if (relaxation_ == Red_Black_Wavefront) {
+        return relax_wavefront<Size, Bounds<None> >(grid, 0, scale, control, zero_guess, relax);
+    }
+
+    if (relaxation_ == Red_Black) {
+        return relax_red_black<Size, Bounds<None> >(grid, 0, scale, control, zero_guess, relax);
+    }
+
+    for (int step = 0; step < control.max_iterations; ++step) {
+        change = 0.0f;
+        bool fresh = zero_guess && step == 0;
+        for (int i = 1; i <= N; ++i) {
+            for (int j = 1; j <= N; ++j) {
+                float a = coefficients(i, j);
                 float c = 1 + 4 * a; 
-                grid(i, j) = (grid_prev(i,j) + a * (grid(i-1,j) + grid(i+1,j) 
-                        + grid(i,j-1) + grid(i,j+1))) / c;
+                float old = fresh ? 0.0f : cells(i, j);
+                float sum = fresh ? cells(i-1,j) + cells(i,j-1)
+                        : cells(i-1,j) + cells(i+1,j) + cells(i,j-1) + cells(i,j+1);
+                float value = (rhs(i,j) + a * sum) / c;
+                change = std::max(change, c * std::fabs(value - old));
+                cells(i, j) = value;
             }
+            Bounds<None>::column(grid, i);
+        }
+        stats.iterations = step + 1;
+        stats.residual = change * scale;
+        if (stats.residual <= control.tolerance) {
+            break;
         }
-        // Adjust the boundaries of the array after changing values
-        adjust_bounds(grid);
     }
+    return stats;
+}
+
+Solver_Stats Fluid_Sim::gauss_seidel_viscosity(Fluid_Grid<float>& grid,
+        Fluid_Grid<float>& grid_prev, bool zero_guess, const Tile_Map* tiles)
+{
+    DISPATCH_SIZE(gauss_seidel_viscosity_fixed, (grid, grid_prev, zero_guess, tiles));
 }
 
-void Fluid_Sim::diffuse_viscosity(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
-        Fluid_Grid<float>& viscosity)
+Solver_Stats Fluid_Sim::diffuse_viscosity(Fluid_Grid<float>& grid,
+        Fluid_Grid<float>& grid_prev)
 {
-    gauss_seidel_viscosity(grid, grid_prev, viscosity);
+    // grid is scratch left over from the last step, don't bother clearing it
+    viscosity_coefficients();
+    const Tile_Map* tiles = sleep_tiles_
+        ? diffusion_tiles(grid_prev, viscosity_peak_, viscosity_control_) : 0;
+    return gauss_seidel_viscosity(grid, grid_prev, true, tiles);
 }
 
-void Fluid_Sim::diffuse(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
+template <int Size>
+Solver_Stats Fluid_Sim::gauss_seidel_viscosity_fixed(Fluid_Grid<float>& x,
+        Fluid_Grid<float>& x_prev, Fluid_Grid<float>& y, Fluid_Grid<float>& y_prev,
+        bool zero_guess, const Tile_Map* tiles)
+{
+    const Solver_Control& control = viscosity_control_;
+    viscosity_coefficients();
+    float rhs_norm = tiles ? tiles->peak() : std::max(max_norm(x_prev), max_norm(y_prev));
+    float scale = 1.0f / (rhs_norm > 0.0f ? rhs_norm : 1.0f);
+    if (zero_guess) {
+        zero_bounds(x);
+        zero_bounds(y);
+    }
+    const int N = Size ? Size : N_;
+    Grid_View<float, Size> xs(x), ys(y), x_rhs(x_prev), y_rhs(y_prev),
+            coefficients(viscosity_coefficient);
+
+    // Each component gets exactly the update the single solve would make.
+    // Twice the body of the single solve's relax, which is past where gcc
+    // stops inlining it into the sweeps on its own.
+    auto relax = [&](int i, int j, bool fresh, bool isolated) __attribute__((always_inline)) {
+        float a = coefficients(i, j);
+        float c = 1 + 4 * a;
+        float old_x = fresh ? 0.0f : xs(i, j);
+        float old_y = fresh ? 0.0f : ys(i, j);
+        float sum_x = isolated ? 0.0f : xs(i-1,j) + xs(i+1,j) + xs(i,j-1) + xs(i,j+1);
+        float sum_y = isolated ? 0.0f : ys(i-1,j) + ys(i+1,j) + ys(i,j-1) + ys(i,j+1);
+        float value_x = (x_rhs(i,j) + a * sum_x) / c;
+        float value_y = (y_rhs(i,j) + a * sum_y) / c;
+        xs(i, j) = value_x;
+        ys(i, j) = value_y;
+        return c * std::max(std::fabs(value_x - old_x), std::fabs(value_y - old_y));
+    };
+    if (tiles) {
+        return relax_tiles<Bounds<None> >(x, &y, scale, control, zero_guess, *tiles, relax);
+    }
+    if (relaxation_ == Red_Black_Wavefront) {
+        return relax_wavefront<Size, Bounds<None> >(x, &y, scale, control, zero_guess, relax);
+    }
+    if (relaxation_ == Red_Black) {
+        return relax_red_black<Size, Bounds<None> >(x, &y, scale, control, zero_guess, relax);
+    }
+
+    Solver_Stats stats;
+    stats.iterations = 0;
+    stats.residual = 0.0f;
+    for (int step = 0; step < control.max_iterations; ++step) {
+        float change = 0.0f;
+        bool fresh = zero_guess && step == 0;
+        for (int i = 1; i <= N; ++i) {
+            for (int j = 1; j <= N; ++j) {
+                float a = coefficients(i, j);
+                float c = 1 + 4 * a;
+                float old_x = fresh ? 0.0f : xs(i, j);
+                float old_y = fresh ? 0.0f : ys(i, j);
+                float sum_x = fresh ? xs(i-1,j) + xs(i,j-1)
+                        : xs(i-1,j) + xs(i+1,j) + xs(i,j-1) + xs(i,j+1);
+                float sum_y = fresh ? ys(i-1,j) + ys(i,j-1)
+                        : ys(i-1,j) + ys(i+1,j) + ys(i,j-1) + ys(i,j+1);
+                float value_x = (x_rhs(i,j) + a * sum_x) / c;
+                float value_y = (y_rhs(i,j) + a * sum_y) / c;
+                change = std::max(change, c * std::max(std::fabs(value_x - old_x),
+                            std::fabs(value_y - old_y)));
+                xs(i, j) = value_x;
+                ys(i, j) = value_y;
+            }
+            Bounds<None>::column(x, i);
+            Bounds<None>::column(y, i);
+        }
+        stats.iterations = step + 1;
+        stats.residual = change * scale;
+        if (stats.residual <= control.tolerance) {
+            break;
+        }
+    }
+    return stats;
+}
+
+Solver_Stats Fluid_Sim::gauss_seidel_viscosity(Fluid_Grid<float>& x,
+        Fluid_Grid<float>& x_prev, Fluid_Grid<float>& y, Fluid_Grid<float>& y_prev,
+        bool zero_guess, const Tile_Map* tiles)
+{
+    DISPATCH_SIZE(gauss_seidel_viscosity_fixed, (x, x_prev, y, y_prev, zero_guess, tiles));
+}
+
+Solver_Stats Fluid_Sim::diffuse_viscosity(Fluid_Grid<float>& x,
+        Fluid_Grid<float>& x_prev, Fluid_Grid<float>& y, Fluid_Grid<float>& y_prev)
+{
+    viscosity_coefficients();
+    const Tile_Map* tiles = sleep_tiles_
+        ? diffusion_tiles(x_prev, viscosity_peak_, viscosity_control_, &y_prev) : 0;
+    return gauss_seidel_viscosity(x, x_prev, y, y_prev, true, tiles);
+}
+
+Solver_Stats Fluid_Sim::diffuse(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
         float rate)
 {
     float a = time_step_ * rate * N_ * N_;
     float c = 1 + 4*a;
-    gauss_seidel (grid, grid_prev, a, c);
+    const Tile_Map* tiles = sleep_tiles_
+        ? diffusion_tiles(grid_prev, a, density_control_) : 0;
+    return gauss_seidel (grid, grid_prev, a, c, density_control_, true, tiles);
 }
  
-void Fluid_Sim::project(Fluid_Grid<float>& x, Fluid_Grid<float>& y, 
+template <int Size>
+Solver_Stats Fluid_Sim::project_fixed(Fluid_Grid<float>& x, Fluid_Grid<float>& y,
         Fluid_Grid<float>& p, Fluid_Grid<float>& div)
 {
+    Solver_Stats stats;
+    // The pressure changes little from one step to the next, so the last
+    // solution on this grid is the best initial guess there is
+    if (!warm_start_) {
+        p.reset();
+    }
+
+    const int N = Size ? Size : N_;
+    Grid_View<float, Size> xs(x), ys(y), ps(p), divs(div);
+
     // _Pragma("omp parallel for")
-    for (int i = 1; i <= N_; ++i) {
-        for (int j = 1; j <= N_; ++j) {
-            div(i,j) = (x(i+1,j) - x(i-1,j) + y(i, j+1) - y(i, j -1)) * -0.5f / N_;
-            p(i,j) = 0;
+    for (int i = 1; i <= N; ++i) {
+        for (int j = 1; j <= N; ++j) {
+            divs(i,j) = (xs(i+1,j) - xs(i-1,j) + ys(i, j+1) - ys(i, j -1)) * -0.5f / N;
         }
     }
     adjust_bounds(div);
     adjust_bounds(p);
-    gauss_seidel (p, div, 1, 4);
+    if (projection_ == Multigrid_Projection) {
+        stats = multigrid_.solve(p, div);
+    } else if (projection_ == PCG_Projection) {
+        stats = pcg_.solve(p, div);
+    } else {
+        stats = gauss_seidel (p, div, 1, 4, pressure_control_);
+    }
     
+    // A tile row at a time, so that with sleep_tiles_ the activity of the
+    // new velocity is measured while it is still in cache
+    if (sleep_tiles_) {
+        if (x_tiles_.N_ != N_) {
+            x_tiles_.resize(N_);
+            y_tiles_.resize(N_);
+        }
+    }
+    // The CFL condition of the next step comes for free while the
+    // velocity is being written anyway
+    float speed = 0.0f;
     // _Pragma("omp parallel for")
-    for (int i = 1; i <= N_; ++i) {
-        for (int j = 1; j <= N_; ++j) {
-            x(i,j) -=  0.5f * N_ * (p(i+1,j) - p(i-1,j));
-            y(i,j) -=  0.5f * N_ * (p(i,j+1) - p(i,j-1));
+    for (int ty = 0; ty * Tile_Size < N; ++ty) {
+        for (int j = 1 + ty * Tile_Size; j <= std::min((ty + 1) * Tile_Size, N); ++j) {
+            for (int i = 1; i <= N; ++i) {
+                xs(i,j) -=  0.5f * N * (ps(i+1,j) - ps(i-1,j));
+                ys(i,j) -=  0.5f * N * (ps(i,j+1) - ps(i,j-1));
+                speed = std::max(speed, std::max(std::fabs(xs(i,j)), std::fabs(ys(i,j))));
+            }
+        }
+        if (sleep_tiles_) {
+            // Ghost cells are stale, but only ever mirror an interior cell
+            x_tiles_.measure_row(x, ty);
+            y_tiles_.measure_row(y, ty);
         }
     }
     adjust_bounds(x);
     adjust_bounds(y);
+    max_velocity_ = speed;
+    return stats;
+}
+
+Solver_Stats Fluid_Sim::project(Fluid_Grid<float>& x, Fluid_Grid<float>& y,
+        Fluid_Grid<float>& p, Fluid_Grid<float>& div)
+{
+    DISPATCH_SIZE(project_fixed, (x, y, p, div));
 }
  
 void Fluid_Sim::advect(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
-        Fluid_Grid<float>& x_velocity, Fluid_Grid<float>& y_velocity)
+        Fluid_Grid<float>& x_velocity, Fluid_Grid<float>& y_velocity,
+        bool velocity_measured)
 {
     int x_lo, x_hi, y_lo, y_hi;
     float x, y, x_w, y_w;
@@ -205,6 +1056,33 @@ void Fluid_Sim::advect(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
     // How much in time to step back
     float dt0 = time_step_ * N_;
 
+    // Tiles whose backtraces only reach zero stay zero
+    const Tile_Map* tiles = 0;
+    if (sleep_tiles_) {
+        if (!velocity_measured) {
+            x_tiles_.measure(x_velocity);
+            y_tiles_.measure(y_velocity);
+        }
+        const Tile_Map* prev_tiles = &field_tiles_;
+        if (grid_prev.array_ == x_velocity.array_) {
+            prev_tiles = &x_tiles_;
+        } else if (grid_prev.array_ == y_velocity.array_) {
+            prev_tiles = &y_tiles_;
+        } else {
+            field_tiles_.measure(grid_prev);
+        }
+        stats_.tiles_awake += advect_activity(advect_tiles_, *prev_tiles,
+                x_tiles_, y_tiles_, dt0, tile_threshold_);
+        stats_.tiles_total += advect_tiles_.tiles_ * advect_tiles_.tiles_;
+        tiles = &advect_tiles_;
+    }
+
+    if (simd_ != Simd_Scalar || tiles) {
+        advect_simd(simd_, grid, grid_prev, x_velocity, y_velocity, dt0, tiles);
+        adjust_bounds(grid);
+        return;
+    }
+
     for (int i = 1; i <= N_; ++i) {
         for (int j = 1; j <= N_; ++j) {
             // Backtrace i according to the velocity field's x value
@@ -5,7 +5,15 @@
 #include <string.h>
 #include "heat.h"
 #include "grid.h"
+#include "advect_simd.h"
+#include "bounds.h"
+#include "injection.h"
 #include "levelset.h"
+#include "multigrid.h"
+#include "pcg.h"
+#include "sources.h"
+#include "task_graph.h"
+#include "tiles.h"
 
 #define FOR_EVERY(N) for(int k=0; k < (N+2)*(N+2); ++k) {int i=k%(N); int j=k/(N);
 #define END_FOR }
@@ -26,52 +34,292 @@ inline void swap(Fluid_Grid<float>& v0, Fluid_Grid<float>& v1) {
     v1.array_ = tmp;
 }
 
+/**
+ * Update order used by the Gauss-Seidel relaxations
+ */
+enum Relaxation_Order
+{
+    Lexicographic,      // in-place row sweep, single threaded
+    Red_Black,          // checkerboard sweep, each colour updated in parallel
+    Red_Black_Wavefront // red-black, several sweeps per pass over the grid
+};
+
+/** Fewest cells of a row a thread relaxes at once in Red_Black_Wavefront */
+const int Wavefront_Chunk = 64;
+
+/**
+ * Linear solver used for the pressure equation in project()
+ */
+enum Projection_Solver
+{
+    Gauss_Seidel_Projection, // fixed number of gauss_seidel sweeps
+    Multigrid_Projection,    // multigrid cycles down to a residual target
+    PCG_Projection           // preconditioned conjugate gradient, ditto
+};
+
+/**
+ * Linear solver telemetry of one simulation step
+ */
+struct Step_Stats {
+    Solver_Stats viscosity[2];   // x and y velocity diffusion
+    Solver_Stats density;        // density diffusion
+    Solver_Stats pressure[2];    // projection after diffusion, after advection
+    int injections;              // input events applied at the start
+    float injection_latency;     // age of the oldest of them, in seconds
+    int tiles_awake;             // tiles advect and diffuse processed,
+    int tiles_total;             // out of this many, with sleep_tiles_
+    int substeps;                // steps the frame took, 1 outside advance_frame
+};
+
 struct Fluid_Sim {
     int N_;                      // simulation dimension
     float diffusion_;            // density diffusion rate
-    float time_step_;            // time between simulation steps
+    float time_step_;            // time between simulation steps, or
+                                 // between display frames with adaptive_
+    bool adaptive_;              // sub-step advance_frame by the CFL number
+    float cfl_;                  // target cells of motion per sub-step
+    int max_substeps_;           // sub-steps per frame at most
+    float max_velocity_;         // largest |x| or |y| the last project left
     bool enable_heat_;           // is heat diffusion enabled
     bool enable_gravity_;        // is gravity enabled
+    Relaxation_Order relaxation_; // gauss seidel update order
+    int wavefront_depth_;        // sweeps per pass for Red_Black_Wavefront
+    bool fuse_viscosity_;        // diffuse x and y velocity in one solve
+    Projection_Solver projection_; // pressure solver used by project
+    bool warm_start_;            // seed each pressure solve with the last one
+    Simd_Level simd_;            // widest instruction set advect may use
+    bool fixed_size_kernels_;    // use the kernels built for N_, if there are
+    bool task_graph_;            // run independent stages of a step at once
+    bool sleep_tiles_;           // skip tiles advect and diffuse leave at zero
+    float tile_threshold_;       // magnitude below which a tile counts as zero
     heat heat_boundary_;
     LevelSet levelset;
-    const int solver_steps = 30; // linear equation solver iterations
+    Multigrid multigrid_;        // pressure solver state for Multigrid_Projection
+    PCG pcg_;                    // pressure solver state for PCG_Projection
+    Solver_Control viscosity_control_; // velocity diffusion tolerance and cap
+    Solver_Control density_control_;   // density diffusion tolerance and cap
+    Solver_Control pressure_control_;  // gauss seidel pressure tolerance and cap
+    Step_Stats stats_;           // solver telemetry of the last step
+    float viscosity_;            // uniform viscosity refilled on resize
+    bool viscosity_dirty_;       // viscosity_grid changed since the coefficients
+    float coefficient_time_step_; // time_step_ and N_ the coefficients are for
+    int coefficient_N_;
+    float viscosity_peak_;       // largest coefficient, 0 for an inviscid fluid
+    Injection_Queue injections_; // input waiting for the next step
+    Grid_Arena<float> arena_;    // storage of all the grids below
     Fluid_Grid<float> x, x_old,
                       y, y_old,
                       density, density_old,
-                      viscosity_grid;
+                      viscosity_grid,
+                      viscosity_coefficient, // a of each cell, time_step_
+                                             // * viscosity_grid * N^2
+                      pressure,         // first projection of a step
+                      pressure_advect;  // projection after advection
+                      // (both persist between steps to warm start solves)
+    // External forces and dye for the next step. The _old grids above are
+    // scratch space of the step and hold no sources between steps.
+    Source_Grid x_source, y_source, density_source;
+    // Activity of the fields advect and diffuse read, with sleep_tiles_.
+    // x_tiles_ and y_tiles_ are those of the velocity project last produced.
+    Tile_Map field_tiles_, x_tiles_, y_tiles_, advect_tiles_, pair_tiles_;
+    // Stages of the last integrate and the dependencies between them, with
+    // how long each took
+    Task_Graph step_graph_;
 
     /** Constructor */
     Fluid_Sim (int N, float viscosity, float diffusion, float time_step);
 
     /** Run a single time step of the simulation */
     void simulation_step();
+
+    /**
+     * Advance the simulation by one display frame of time_step_. With
+     * adaptive_ the frame is split into even sub-steps that move the
+     * fastest velocity of the last projection at most cfl_ cells, up to
+     * max_substeps_ of them; otherwise this is one simulation_step. Input
+     * is applied once and the sources act for the whole frame.
+     * @returns Number of sub-steps taken
+     */
+    int advance_frame();
+
+    /**
+     * One step of time_step_ with the sources as they are, shared by
+     * simulation_step and advance_frame. Leaves the sources in place.
+     * The stages of the step go through step_graph_: in the order they
+     * were added, or with task_graph_ each as soon as its inputs are done,
+     * side by side with whatever else is running and its loops on the same
+     * threads. Either way every stage sees the same inputs, so the result
+     * is the same.
+     */
+    void integrate();
+
+    /** Drop the sources once the step or frame they were queued for is done */
+    void clear_sources();
+
+    /**
+     * Queue input for the next step. Safe to call from one thread other
+     * than the one stepping, and never blocks.
+     * @returns false if the queue is full and the event was dropped
+     */
+    bool inject(const Injection& event) { return injections_.push(event); }
+
+    /** Apply all queued input, called at the start of simulation_step */
+    void apply_injections();
+
+    /** Make the viscosity uniform */
+    void set_viscosity(float viscosity);
+
+    /** Call after writing viscosity_grid directly, so the solver sees it */
+    void invalidate_viscosity() { viscosity_dirty_ = true; }
+
+    /**
+     * Recompute viscosity_coefficient if viscosity_grid, time_step_ or N_
+     * changed since it was last computed
+     * @returns false if every coefficient is zero and there is nothing to
+     *     diffuse
+     */
+    bool viscosity_coefficients();
     void reset();
     void resize(int N);
 
-    void add_external_forces(Fluid_Grid<float>& target, 
-            Fluid_Grid<float>& source);
+    /** target += time_step_ * sources, touching only cells with a source */
+    void add_external_forces(Fluid_Grid<float>& target, const Source_Grid& sources);
     
     void add_gravity(Fluid_Grid<float>& y); 
 
+    /** Refresh the ghost cells of grid for its grid.type_ */
     void adjust_bounds(Fluid_Grid<float>& grid);
 
-    void gauss_seidel(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
-            float a, float c);
+    /** Solver telemetry of the last simulation step */
+    const Step_Stats& step_stats() const { return stats_; }
 
-    void diffuse(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev, 
+    /**
+     * Dimension the solver kernels are specialized for at compile time:
+     * N_ if it is one of 128, 256, 512 or 1024, the grids have the default
+     * stride and fixed_size_kernels_ is set, else 0 for the generic kernels
+     */
+    int kernel_size() const;
+
+    /**
+     * Relax (c x - a (sum of neighbours) = grid_prev) until the residual
+     * relative to grid_prev drops below control.tolerance, or for at most
+     * control.max_iterations sweeps. The ghost cells are mirrored as for a
+     * None grid, whatever grid.type_.
+     * @param zero_guess start from zero instead of the contents of grid,
+     *     which then need not be cleared beforehand
+     * @param tiles if given, red-black sweeps over its active tiles only and
+     *     zero the cells of the others, whatever relaxation_ says
+     */
+    Solver_Stats gauss_seidel(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
+            float a, float c, const Solver_Control& control, bool zero_guess = false,
+            const Tile_Map* tiles = 0);
+
+    /** gauss_seidel for grids of dimension Size, see kernel_size() */
+    template <int Size>
+    Solver_Stats gauss_seidel_fixed(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
+            float a, float c, const Solver_Control& control, bool zero_guess,
+            const Tile_Map* tiles);
+
+    Solver_Stats diffuse(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev, 
             float rate);
 
-    void gauss_seidel_viscosity(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
-            Fluid_Grid<float>& viscosity);
+    /**
+     * Red_Black_Wavefront relaxation shared by the gauss seidel variants.
+     * relax(i, j, old, neighbours) updates one cell and returns its residual
+     * before the update, which scale turns into a relative residual. old and
+     * neighbours say whether the cell and its neighbours hold their current
+     * values, or still the zero initial guess and should be read as zero.
+     * other, if not null, is a second grid relax updates alongside grid.
+     * Boundary is the Bounds policy both grids' ghost cells follow; the
+     * sweeps refresh them as they go rather than in a pass of their own.
+     * Size is the dimension of the grids, 0 if not known at compile time.
+     */
+    template <int Size, typename Boundary, typename Relax>
+    Solver_Stats relax_wavefront(Fluid_Grid<float>& grid, Fluid_Grid<float>* other,
+            float scale, const Solver_Control& control, bool zero_guess, Relax relax);
+
+    /** Red_Black relaxation, same arguments as above */
+    template <int Size, typename Boundary, typename Relax>
+    Solver_Stats relax_red_black(Fluid_Grid<float>& grid, Fluid_Grid<float>* other,
+            float scale, const Solver_Control& control, bool zero_guess, Relax relax);
+
+    /** Red-black relaxation over the active tiles of tiles, same relax as above */
+    template <typename Boundary, typename Relax>
+    Solver_Stats relax_tiles(Fluid_Grid<float>& grid, Fluid_Grid<float>* other,
+            float scale, const Solver_Control& control, bool zero_guess,
+            const Tile_Map& tiles, Relax relax);
+
+    /**
+     * Tiles a diffusion of rhs with coefficient a can make nonzero: those
+     * within reach of a tile of rhs above tile_threshold_. With rhs_other,
+     * those of a fused solve of both.
+     */
+    const Tile_Map* diffusion_tiles(Fluid_Grid<float>& rhs, float a,
+            const Solver_Control& control, Fluid_Grid<float>* rhs_other = 0);
+
+    /**
+     * gauss_seidel with the per-cell coefficients of viscosity_grid,
+     * controlled by viscosity_control_
+     */
+    Solver_Stats gauss_seidel_viscosity(Fluid_Grid<float>& grid,
+            Fluid_Grid<float>& grid_prev, bool zero_guess = false,
+            const Tile_Map* tiles = 0);
+
+    template <int Size>
+    Solver_Stats gauss_seidel_viscosity_fixed(Fluid_Grid<float>& grid,
+            Fluid_Grid<float>& grid_prev, bool zero_guess, const Tile_Map* tiles);
+
+    Solver_Stats diffuse_viscosity(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev);
+
+    /**
+     * Both velocity components relaxed in one sweep, reading each cell's
+     * coefficient once for the two of them. The residual is that of the
+     * pair relative to the larger right hand side, i.e. to the velocity as
+     * a whole.
+     */
+    Solver_Stats gauss_seidel_viscosity(Fluid_Grid<float>& x, Fluid_Grid<float>& x_prev,
+            Fluid_Grid<float>& y, Fluid_Grid<float>& y_prev, bool zero_guess = false,
+            const Tile_Map* tiles = 0);
+
+    template <int Size>
+    Solver_Stats gauss_seidel_viscosity_fixed(Fluid_Grid<float>& x,
+            Fluid_Grid<float>& x_prev, Fluid_Grid<float>& y, Fluid_Grid<float>& y_prev,
+            bool zero_guess, const Tile_Map* tiles);
+
+    Solver_Stats diffuse_viscosity(Fluid_Grid<float>& x, Fluid_Grid<float>& x_prev,
+            Fluid_Grid<float>& y, Fluid_Grid<float>& y_prev);
+
+    /**
+     * The viscous stage of one velocity component on its own: diffuse
+     * grid_prev into grid, or for an inviscid fluid viscous_copy it
+     */
+    void viscous_solve(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
+            Solver_Stats& stats);
+
+    /** What a solve with no viscosity amounts to: swap, then mirror bounds */
+    void viscous_copy(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
+            Solver_Stats& stats);
 
-    void diffuse_viscosity(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev, 
-            Fluid_Grid<float>& viscosity);
+    /**
+     * Make the velocity field divergence free, and record its largest
+     * component in max_velocity_
+     * @returns Iterations and final relative residual of the pressure solve
+     */
+    Solver_Stats project(Fluid_Grid<float>& x, Fluid_Grid<float>& y,
+            Fluid_Grid<float>& p, Fluid_Grid<float>& div);
 
-    void project(Fluid_Grid<float>& x, Fluid_Grid<float>& y, Fluid_Grid<float>& p,
-            Fluid_Grid<float>& div);
+    template <int Size>
+    Solver_Stats project_fixed(Fluid_Grid<float>& x, Fluid_Grid<float>& y,
+            Fluid_Grid<float>& p, Fluid_Grid<float>& div);
         
+    /**
+     * Semi-Lagrangian advection of grid_prev into grid
+     * @param velocity_measured with sleep_tiles_, x_tiles_ and y_tiles_
+     *     already hold the activity of the velocity, as project leaves them
+     */
     void advect(Fluid_Grid<float>& grid, Fluid_Grid<float>& grid_prev,
-        Fluid_Grid<float>& x_velocity, Fluid_Grid<float>& y_velocity);
+        Fluid_Grid<float>& x_velocity, Fluid_Grid<float>& y_velocity,
+        bool velocity_measured = false);
 
     void debug_print (Fluid_Grid<float>& grid) {
         printf("----- PRINTY -----\n");
@@ -1,5 +1,11 @@
 #ifndef GRID_H
 #define GRID_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
 /**
  * Difference grid types require different handling
  * for boundary conditions
@@ -8,53 +14,266 @@ enum Grid_Type
 {
     Density,
     X_Velocity,
-    Y_Velocity, 
+    Y_Velocity,
     None
-}; 
+};
+
+/** Byte alignment of grid storage, one cache line / AVX-512 register */
+const int Grid_Alignment = 64;
+
+/** Aligned allocation of n elements, throws std::bad_alloc on failure */
+template <typename T>
+T* grid_allocate(size_t n)
+{
+    void* memory = 0;
+    if (posix_memalign(&memory, Grid_Alignment, std::max<size_t>(n, 1) * sizeof(T)) != 0) {
+        throw std::bad_alloc();
+    }
+    return static_cast<T*>(memory);
+}
+
+/** Elements of T per alignment unit */
+template <typename T>
+constexpr int grid_lanes()
+{
+    return (Grid_Alignment / (int) sizeof(T) > 1) ? Grid_Alignment / (int) sizeof(T) : 1;
+}
+
+/** N+2 rounded up to whole alignment units */
+template <typename T>
+constexpr int grid_rounded_stride(int N)
+{
+    return (N + 1 + grid_lanes<T>()) / grid_lanes<T>() * grid_lanes<T>();
+}
+
+/**
+ * Default row stride for dimension N, see Fluid_Grid::padded_stride. A
+ * constant expression, so fixed-size kernels can fold it in.
+ */
+template <typename T>
+constexpr int grid_padded_stride(int N)
+{
+    return (grid_rounded_stride<T>(N) * sizeof(T)) % 4096 == 0
+        ? grid_rounded_stride<T>(N) + grid_lanes<T>() : grid_rounded_stride<T>(N);
+}
 
+template <typename T> struct Grid_Arena;
+
+/**
+ * Rows of a grid are stride_ elements apart, with stride_ >= N+2. The array
+ * is offset so that cell (1, j), the first interior cell of every row, starts
+ * on a Grid_Alignment boundary. Elements past N+1 in a row are padding; they
+ * are zeroed with the rest of the array and never read by the solvers.
+ */
 template <typename T>
 struct Fluid_Grid {
     T* array_;
-    Grid_Type type_;
+    const Grid_Type type_;       // boundary conditions, fixed for life
     int N_;
+    int stride_;                 // elements between the starts of two rows
 
-    Fluid_Grid(int N, Grid_Type type = None) : N_(N), type_(type) {
-        array_ = new T[(N+2)*(N+2)];
-        
-        // Zero out array 
-        set_all(0);
-    } 
+    /** Elements per alignment unit */
+    static int lanes() {
+        return grid_lanes<T>();
+    }
+
+    /** Elements in front of cell (0, 0) that align cell (1, 0) */
+    static int lead() {
+        return lanes() - 1;
+    }
+
+    /**
+     * Default row stride for dimension N: N+2 rounded up to whole alignment
+     * units, plus one more unit when that would make rows a multiple of
+     * 4 KB apart, where every row of a column maps to the same cache set
+     */
+    static int padded_stride(int N) {
+        return grid_padded_stride<T>(N);
+    }
+
+    /** Elements a grid of dimension N needs, lead and padding included */
+    static size_t footprint(int N, int stride) {
+        return lead() + (size_t) stride * (N + 2);
+    }
+
+    /**
+     * Grid with its own storage
+     * @param stride row stride, 0 for padded_stride(N)
+     */
+    Fluid_Grid(int N, Grid_Type type = None, int stride = 0)
+        : array_(0), type_(type), N_(0), stride_(0), owner_(true) {
+        resize(N, stride);
+    }
+
+    /** Grid whose storage is laid out by arena.layout() */
+    Fluid_Grid(Grid_Arena<T>& arena, Grid_Type type = None)
+        : array_(0), type_(type), N_(0), stride_(0), owner_(false) {
+        arena.grids_.push_back(this);
+    }
 
     /** Zero out the internal array */
     void reset() {
-        // Zero out array 
+        // Zero out array
         set_all(0);
     }
 
-    /** Resize the internal array, then zero out new array */
-    void resize(int N) {
+    /**
+     * Resize the internal array, then zero out new array. Grids drawn from
+     * an arena are resized through Grid_Arena::layout instead.
+     * @param stride row stride, 0 for padded_stride(N)
+     */
+    void resize(int N, int stride = 0) {
+        if (!owner_) {
+            return;
+        }
+        release();
         N_ = N;
-        delete[] array_;
-        array_ = new T[(N+2)*(N+2)];
+        stride_ = (stride > 0) ? stride : padded_stride(N);
+        array_ = grid_allocate<T>(footprint(N_, stride_)) + lead();
         reset();
     }
 
+    /** Number of elements from cell (0, 0) to the end of the array */
+    size_t size() const {
+        return (size_t) stride_ * (N_ + 2);
+    }
+
     /** Set all values of the array to some value, v */
     void set_all(T v) {
-		std::fill(array_, array_ + (N_+2)*(N_+2), v);
+		std::fill(array_, array_ + size(), v);
     }
 
     Fluid_Grid(const Fluid_Grid&) = delete;
     Fluid_Grid& operator = (const Fluid_Grid&) = delete;
 
     ~Fluid_Grid() {
-        delete[] array_;
+        release();
     }
 
     /** 2D access operator */
-    T& operator () (int i, int j) { 
-        return array_[i + (N_+2) * j]; 
-    }    
+    T& operator () (int i, int j) {
+        return array_[i + stride_ * j];
+    }
+
+    const T& operator () (int i, int j) const {
+        return array_[i + stride_ * j];
+    }
+
+private:
+    bool owner_;                 // false when the storage belongs to an arena
+
+    void release() {
+        if (owner_ && array_) {
+            free(array_ - lead());
+        }
+        array_ = 0;
+    }
+};
+
+/**
+ * Cell access to a grid whose dimension is fixed at compile time to Size,
+ * so that kernels written against it see the row stride and their loop
+ * bounds as constants to fold, unroll and vectorize with. Only valid for a
+ * grid of dimension Size with the default padded_stride(Size). Size 0 is
+ * the generic view, which reads both from the grid instead.
+ */
+template <typename T, int Size>
+struct Grid_View {
+    static const int stride_ = grid_padded_stride<T>(Size);
+    T* array_;
+
+    explicit Grid_View(Fluid_Grid<T>& grid) : array_(grid.array_) {}
+
+    int N() const { return Size; }
+
+    T& operator () (int i, int j) const {
+        return array_[i + stride_ * j];
+    }
+};
+
+template <typename T>
+struct Grid_View<T, 0> {
+    T* array_;
+    int N_;
+    int stride_;
+
+    explicit Grid_View(Fluid_Grid<T>& grid)
+        : array_(grid.array_), N_(grid.N_), stride_(grid.stride_) {}
+
+    int N() const { return N_; }
+
+    T& operator () (int i, int j) const {
+        return array_[i + stride_ * j];
+    }
+};
+
+/**
+ * One contiguous, aligned allocation shared by a set of equally sized grids.
+ * Grids register themselves on construction; layout() carves the block up
+ * between them. Storage is only reallocated when a layout needs more than
+ * the block holds, so shrinking and growing back reuse the same memory.
+ *
+ * The arena must outlive its grids. Swapping the arrays of two of its grids
+ * is fine, as every grid's slot is handed out again on the next layout.
+ */
+template <typename T>
+struct Grid_Arena {
+    std::vector<Fluid_Grid<T>*> grids_;
+
+    Grid_Arena() : storage_(0), capacity_(0) {}
+
+    Grid_Arena(const Grid_Arena&) = delete;
+    Grid_Arena& operator = (const Grid_Arena&) = delete;
+
+    ~Grid_Arena() {
+        free(storage_);
+    }
+
+    /**
+     * Resize every registered grid to dimension N and zero it
+     * @param stride row stride, 0 for Fluid_Grid<T>::padded_stride(N)
+     */
+    void layout(int N, int stride = 0) {
+        if (stride <= 0) {
+            stride = Fluid_Grid<T>::padded_stride(N);
+        }
+        size_t slot = slot_size(N, stride);
+        size_t needed = slot * grids_.size();
+        if (needed > capacity_) {
+            free(storage_);
+            storage_ = 0;
+            capacity_ = 0;
+            storage_ = grid_allocate<T>(needed);
+            capacity_ = needed;
+        }
+        for (size_t g = 0; g < grids_.size(); ++g) {
+            Fluid_Grid<T>& grid = *grids_[g];
+            grid.N_ = N;
+            grid.stride_ = stride;
+            grid.array_ = storage_ + g * slot + Fluid_Grid<T>::lead();
+            grid.reset();
+        }
+    }
+
+    /** Elements currently allocated */
+    size_t capacity() const { return capacity_; }
+
+private:
+    T* storage_;
+    size_t capacity_;
+
+    /**
+     * Whole alignment units per grid, plus one when grids would start a
+     * multiple of 4 KB apart and alias the same cache sets cell for cell
+     */
+    static size_t slot_size(int N, int stride) {
+        size_t lanes = Fluid_Grid<T>::lanes();
+        size_t slot = (Fluid_Grid<T>::footprint(N, stride) + lanes - 1) / lanes * lanes;
+        if ((slot * sizeof(T)) % 4096 == 0) {
+            slot += lanes;
+        }
+        return slot;
+    }
 };
 
 #endif // GRID_H
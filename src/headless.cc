@@ -0,0 +1,376 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "fluid.h"
+
+/**
+ * Batch runner for the simulation core. No window, no GL context -- just
+ * Fluid_Sim::simulation_step in a loop, so solver throughput can be measured
+ * on render-less machines.
+ *
+ * Schedule file format, one source per line ('#' starts a comment):
+ *
+ *   <first_step>[:<last_step>]  velocity  <i> <j> <x_force> <y_force>
+ *   <first_step>[:<last_step>]  density   <i> <j> <amount> [radius]
+ *
+ * A source is queued as an Injection before every step in
+ * [first_step, last_step]. The density brush covers the same square block
+ * the mouse brush in main.cc does.
+ */
+
+enum Source_Kind
+{
+    Velocity_Source,
+    Density_Source
+};
+
+struct Scheduled_Source {
+    int first_step;
+    int last_step;
+    Source_Kind kind;
+    int i, j;
+    float value0;
+    float value1;
+};
+
+static void usage(const char* program)
+{
+    std::cerr << "usage: " << program << " [options]\n"
+              << "  -n <int>          grid dimension (default " << config::N << ")\n"
+              << "  -dt <float>       time step (default " << config::time_step << ")\n"
+              << "  -visc <float>     viscosity (default " << config::viscosity << ")\n"
+              << "  -diff <float>     density diffusion (default " << config::diffusion << ")\n"
+              << "  -steps <int>      number of simulation steps (default 100)\n"
+              << "  -adaptive [cfl]   treat -dt as a frame and sub-step it to the CFL\n"
+              << "                    number (default 2); -steps then counts frames\n"
+              << "  -relax <lex|rb|wavefront> gauss seidel order: lexicographic, red-black,\n"
+              << "                    or red-black with several sweeps per pass\n"
+              << "  -depth <int>      sweeps per pass of the wavefront order (default 4)\n"
+              << "  -separate-viscosity diffuse x and y velocity in two solves instead\n"
+              << "                    of one fused sweep\n"
+              << "  -generic          skip the solver kernels built for N = 128, 256,\n"
+              << "                    512 and 1024\n"
+              << "  -tasks            run independent stages of a step at once, and\n"
+              << "                    report the time of each and the critical path\n"
+              << "  -projection <gs|mg|mg-w|pcg|pcg-jacobi>\n"
+              << "                    pressure solver: gauss seidel, multigrid V/W-cycles,\n"
+              << "                    or conjugate gradient with MIC(0)/Jacobi preconditioner\n"
+              << "  -tolerance <float> relative residual target of the pressure solver\n"
+              << "  -simd <scalar|sse|avx2|avx512> widest advect kernel (default: best)\n"
+              << "  -tiles [threshold] skip " << Tile_Size << "x" << Tile_Size
+              << " tiles advect and diffuse leave below\n"
+              << "                    threshold (default 1e-6)\n"
+              << "  -liquid <float>   track a liquid surface, starting as a pool filling\n"
+              << "                    that fraction of the height\n"
+              << "  -schedule <file>  scripted source/force schedule\n";
+}
+
+static bool load_schedule(const std::string& path, std::vector<Scheduled_Source>& schedule)
+{
+    std::ifstream in(path.c_str());
+    if (!in) {
+        std::cerr << "Could not open schedule: " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        ++line_no;
+        std::string::size_type comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+
+        std::istringstream ss(line);
+        std::string steps, kind;
+        if (!(ss >> steps)) {
+            continue; // blank line
+        }
+
+        Scheduled_Source source;
+        std::string::size_type colon = steps.find(':');
+        source.first_step = std::atoi(steps.substr(0, colon).c_str());
+        source.last_step  = (colon == std::string::npos) ? source.first_step
+            : std::atoi(steps.substr(colon + 1).c_str());
+
+        bool ok = static_cast<bool>(ss >> kind >> source.i >> source.j >> source.value0);
+        if (ok && kind == "velocity") {
+            source.kind = Velocity_Source;
+            ok = static_cast<bool>(ss >> source.value1);
+        } else if (ok && kind == "density") {
+            source.kind = Density_Source;
+            source.value1 = 4; // same brush as the viewer
+            ss >> source.value1;
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            std::cerr << path << ":" << line_no << ": malformed source" << std::endl;
+            return false;
+        }
+        schedule.push_back(source);
+    }
+    return true;
+}
+
+static void inject_sources(Fluid_Sim& sim, const std::vector<Scheduled_Source>& schedule,
+        int step)
+{
+    for (size_t s = 0; s < schedule.size(); ++s) {
+        const Scheduled_Source& source = schedule[s];
+        if (step < source.first_step || step > source.last_step) {
+            continue;
+        }
+        Injection event = (source.kind == Velocity_Source)
+            ? Injection::impulse(source.i, source.j, source.value0, source.value1)
+            : Injection::splat(source.i, source.j, source.value0, (int) source.value1);
+        if (!sim.inject(event)) {
+            // Same thread steps the sim, so flushing early changes nothing
+            sim.apply_injections();
+            sim.inject(event);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int N = config::N;
+    float time_step = config::time_step;
+    float viscosity = config::viscosity;
+    float diffusion = config::diffusion;
+    int steps = 100;
+    std::string schedule_path;
+    Relaxation_Order relaxation = Lexicographic;
+    int wavefront_depth = 4;
+    bool fuse_viscosity = true;
+    bool fixed_size_kernels = true;
+    bool task_graph = false;
+    float liquid = -1.0f;
+    std::string projection = "gs";
+    float tolerance = -1.0f;
+    Simd_Level simd = detect_simd_level();
+    float tile_threshold = -1.0f;
+    float cfl = -1.0f;
+
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        bool has_value = a + 1 < argc;
+        if (arg == "-n" && has_value) {
+            N = std::atoi(argv[++a]);
+        } else if (arg == "-dt" && has_value) {
+            time_step = std::atof(argv[++a]);
+        } else if (arg == "-visc" && has_value) {
+            viscosity = std::atof(argv[++a]);
+        } else if (arg == "-diff" && has_value) {
+            diffusion = std::atof(argv[++a]);
+        } else if (arg == "-steps" && has_value) {
+            steps = std::atoi(argv[++a]);
+        } else if (arg == "-schedule" && has_value) {
+            schedule_path = argv[++a];
+        } else if (arg == "-relax" && has_value) {
+            std::string order = argv[++a];
+            if (order == "lex") {
+                relaxation = Lexicographic;
+            } else if (order == "rb") {
+                relaxation = Red_Black;
+            } else if (order == "wavefront") {
+                relaxation = Red_Black_Wavefront;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "-depth" && has_value) {
+            wavefront_depth = std::atoi(argv[++a]);
+        } else if (arg == "-separate-viscosity") {
+            fuse_viscosity = false;
+        } else if (arg == "-generic") {
+            fixed_size_kernels = false;
+        } else if (arg == "-tasks") {
+            task_graph = true;
+        } else if (arg == "-liquid" && has_value) {
+            liquid = std::atof(argv[++a]);
+        } else if (arg == "-projection" && has_value) {
+            projection = argv[++a];
+            if (projection != "gs" && projection != "mg" && projection != "mg-w"
+                    && projection != "pcg" && projection != "pcg-jacobi") {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "-tolerance" && has_value) {
+            tolerance = std::atof(argv[++a]);
+        } else if (arg == "-simd" && has_value) {
+            std::string name = argv[++a];
+            int level = Simd_Scalar;
+            while (level <= Simd_AVX512 && name != simd_level_name((Simd_Level) level)) {
+                ++level;
+            }
+            if (level > Simd_AVX512) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            simd = (Simd_Level) level;
+        } else if (arg == "-adaptive") {
+            cfl = 2.0f;
+            if (has_value && argv[a + 1][0] != '-') {
+                cfl = std::atof(argv[++a]);
+            }
+        } else if (arg == "-tiles") {
+            tile_threshold = 1e-6f;
+            if (has_value && argv[a + 1][0] != '-') {
+                tile_threshold = std::atof(argv[++a]);
+            }
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (N < 1 || steps < 0 || (cfl != -1.0f && cfl <= 0.0f)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Scheduled_Source> schedule;
+    if (!schedule_path.empty() && !load_schedule(schedule_path, schedule)) {
+        return EXIT_FAILURE;
+    }
+
+    Fluid_Sim fluid_sim(N, viscosity, diffusion, time_step);
+    fluid_sim.relaxation_ = relaxation;
+    fluid_sim.wavefront_depth_ = wavefront_depth;
+    fluid_sim.fuse_viscosity_ = fuse_viscosity;
+    fluid_sim.fixed_size_kernels_ = fixed_size_kernels;
+    fluid_sim.task_graph_ = task_graph;
+    float start_volume = 0.0f;
+    if (liquid >= 0.0f) {
+        fluid_sim.levelset.fill_below(liquid * N);
+        fluid_sim.levelset.extract_surface(false);
+        start_volume = fluid_sim.levelset.volume_;
+    }
+    fluid_sim.simd_ = simd;
+    fluid_sim.sleep_tiles_ = tile_threshold >= 0.0f;
+    fluid_sim.tile_threshold_ = std::max(tile_threshold, 0.0f);
+    fluid_sim.adaptive_ = cfl > 0.0f;
+    if (fluid_sim.adaptive_) {
+        fluid_sim.cfl_ = cfl;
+    }
+    if (projection == "mg" || projection == "mg-w") {
+        fluid_sim.projection_ = Multigrid_Projection;
+        fluid_sim.multigrid_.cycle_ = (projection == "mg-w") ? W_Cycle : V_Cycle;
+    } else if (projection == "pcg" || projection == "pcg-jacobi") {
+        fluid_sim.projection_ = PCG_Projection;
+        fluid_sim.pcg_.preconditioner_ = (projection == "pcg-jacobi")
+            ? Jacobi_Preconditioner : MIC_Preconditioner;
+    }
+    if (tolerance >= 0.0f) {
+        fluid_sim.multigrid_.control_.tolerance = tolerance;
+        fluid_sim.pcg_.control_.tolerance = tolerance;
+        fluid_sim.pressure_control_.tolerance = tolerance;
+    }
+
+    // Per solver totals of the step telemetry: viscosity x/y, density, pressure x2
+    const char* solver_names[] = { "viscosity", "density", "pressure" };
+    long solver_iterations[3] = { 0, 0, 0 };
+    float worst_residual[3] = { 0.0f, 0.0f, 0.0f };
+    long tiles_awake = 0, tiles_total = 0;
+    long substeps = 0;
+    // Per stage of the last step of each frame: seconds, and how often it
+    // was on the critical path
+    std::vector<double> stage_seconds;
+    std::vector<int> stage_critical;
+    double graph_seconds = 0.0, critical_seconds = 0.0, busy_seconds = 0.0;
+    std::vector<int> path;
+
+    typedef std::chrono::steady_clock clock;
+    clock::time_point beg = clock::now();
+    for (int step = 0; step < steps; ++step) {
+        inject_sources(fluid_sim, schedule, step);
+        substeps += fluid_sim.advance_frame();
+
+        const Step_Stats& stats = fluid_sim.step_stats();
+        const Solver_Stats* solves[5] = { &stats.viscosity[0], &stats.viscosity[1],
+            &stats.density, &stats.pressure[0], &stats.pressure[1] };
+        const int solver_of[5] = { 0, 0, 1, 2, 2 };
+        for (int s = 0; s < 5; ++s) {
+            int k = solver_of[s];
+            solver_iterations[k] += solves[s]->iterations;
+            worst_residual[k] = std::max(worst_residual[k], solves[s]->residual);
+        }
+        tiles_awake += stats.tiles_awake;
+        tiles_total += stats.tiles_total;
+
+        const Task_Graph& graph = fluid_sim.step_graph_;
+        stage_seconds.resize(graph.tasks_.size(), 0.0);
+        stage_critical.resize(graph.tasks_.size(), 0);
+        for (size_t t = 0; t < graph.tasks_.size(); ++t) {
+            stage_seconds[t] += graph.duration((int) t);
+        }
+        critical_seconds += graph.critical_path(&path);
+        for (size_t k = 0; k < path.size(); ++k) {
+            ++stage_critical[path[k]];
+        }
+        graph_seconds += graph.elapsed();
+        busy_seconds += graph.busy();
+    }
+    clock::time_point end = clock::now();
+
+    double seconds = std::chrono::duration<double>(end - beg).count();
+    double density_sum = 0.0;
+    for (int i = 1; i <= N; ++i) {
+        for (int j = 1; j <= N; ++j) {
+            density_sum += fluid_sim.density(i, j);
+        }
+    }
+
+    std::cout << "N:            " << N << "\n"
+              << "steps:        " << steps << "\n"
+              << "seconds:      " << seconds << "\n"
+              << "steps/second: " << (seconds > 0.0 ? steps / seconds : 0.0) << "\n"
+              << "density sum:  " << density_sum << "\n";
+    const int solves_per_step[3] = { 2, 1, 2 };
+    for (int k = 0; k < 3; ++k) {
+        double solves = (double) solves_per_step[k] * std::max(steps, 1);
+        std::cout << solver_names[k] << " iterations/solve: "
+                  << solver_iterations[k] / solves
+                  << ", worst residual: " << worst_residual[k] << "\n";
+    }
+    if (fluid_sim.adaptive_) {
+        std::cout << "substeps/frame: " << substeps / (double) std::max(steps, 1) << "\n";
+    }
+    if (liquid >= 0.0f) {
+        // Nothing adds or removes liquid, so any change is the level set's error
+        fluid_sim.levelset.extract_surface(false);
+        float volume = fluid_sim.levelset.volume_;
+        std::cout << "liquid volume: " << volume << ", drift "
+                  << (start_volume > 0.0f ? 100.0f * (volume - start_volume) / start_volume : 0.0f)
+                  << "% since the start\n";
+    }
+    if (tiles_total > 0) {
+        std::cout << "tiles awake:  " << 100.0 * tiles_awake / tiles_total << "%\n";
+    }
+    if (task_graph && steps > 0) {
+        // Stages marked * were on the critical path in most steps
+        const Task_Graph& graph = fluid_sim.step_graph_;
+        std::cout << "stage ms/step:\n";
+        for (size_t t = 0; t < graph.tasks_.size(); ++t) {
+            std::cout << (2 * stage_critical[t] > steps ? "  * " : "    ")
+                      << graph.tasks_[t].name_ << ": "
+                      << 1e3 * stage_seconds[t] / steps << "\n";
+        }
+        // Stage time over step time: how many stages ran at once on average
+        std::cout << "step ms:      " << 1e3 * graph_seconds / steps
+                  << ", critical path " << 1e3 * critical_seconds / steps
+                  << ", stages in flight "
+                  << (graph_seconds > 0.0 ? busy_seconds / graph_seconds : 0.0) << "\n";
+    }
+    std::cout << std::flush;
+    return EXIT_SUCCESS;
+}
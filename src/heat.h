@@ -27,13 +27,21 @@ public:
     {
         // Set new radius
         radius_ += expansion; 
+        return outline(radius_);
+    }
 
+    /**
+     * Line loop of the boundary at a given radius, without expanding it.
+     * Lets a renderer draw the radius of the frame it shows.
+     */
+    std::vector<glm::vec2> outline(float radius) const
+    {
         // Generate vertices to be used for a line loop
         std::vector<glm::vec2> boundary;
         for (int i = 0; i <= circle_vertices; ++i) {
             glm::vec2 vertex;
-            vertex[0] = x + (radius_ * std::cos(i * TWO_PI / circle_vertices)); 
-            vertex[1] = y + (radius_ * std::sin(i * TWO_PI / circle_vertices)); 
+            vertex[0] = x + (radius * std::cos(i * TWO_PI / circle_vertices)); 
+            vertex[1] = y + (radius * std::sin(i * TWO_PI / circle_vertices)); 
             boundary.push_back(vertex);
         }
         return boundary;
@@ -44,10 +52,15 @@ public:
         radius_ += expansion;
     }
 
-    void apply_heat(Fluid_Grid<float>& viscosity)
+    /**
+     * Lower the viscosity inside the circle
+     * @returns Whether any cell of viscosity changed
+     */
+    bool apply_heat(Fluid_Grid<float>& viscosity)
     {
         float grid_x, grid_y, dx, dy, dist;
         int N = viscosity.N_;
+        bool changed = false;
         for (int i = 1; i <= N; ++i) {
              for (int j = 1; j <= N; ++j) {
                  grid_x = (j / (float)N) * 2.0f - 1;
@@ -56,12 +69,14 @@ public:
                  dy = y - grid_y;
                  dist = std::sqrt(dx*dx + dy*dy);
                  if (dist < radius_) {
-                    float visc = viscosity(i,j) - visc_rate; 
-                    viscosity(i,j) = std::max(0.0f, visc); 
+                    float visc = std::max(0.0f, viscosity(i,j) - visc_rate); 
+                    changed = changed || visc != viscosity(i,j);
+                    viscosity(i,j) = visc; 
                     // std::cout << "viscosity: " << viscosity(i,j) << std::endl;
                  }
              }
         }
+        return changed;
     }
 
     float radius() { return radius_; }
@@ -0,0 +1,103 @@
+#ifndef INJECTION_H
+#define INJECTION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+/**
+ * Kinds of input the simulation accepts between steps
+ */
+enum Injection_Type
+{
+    Velocity_Impulse,   // set the x/y force of one cell
+    Dye_Splat,          // set the density source of a square block
+    Viscosity_Change    // replace the uniform viscosity
+};
+
+/**
+ * One timestamped input event, applied at the start of the next step
+ */
+struct Injection {
+    Injection_Type type_;
+    double time_;       // steady clock seconds when the input happened
+    int i_, j_;         // target cell, clamped to the grid when applied
+    float x_, y_;       // Velocity_Impulse: force on x and y velocity
+    float amount_;      // Dye_Splat: density; Viscosity_Change: viscosity
+    int radius_;        // Dye_Splat: half width of the block in cells
+
+    /** Seconds on the clock events are stamped with */
+    static double now() {
+        return std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static Injection impulse(int i, int j, float x, float y) {
+        Injection event = { Velocity_Impulse, now(), i, j, x, y, 0.0f, 0 };
+        return event;
+    }
+
+    static Injection splat(int i, int j, float amount, int radius) {
+        Injection event = { Dye_Splat, now(), i, j, 0.0f, 0.0f, amount, radius };
+        return event;
+    }
+
+    static Injection viscosity(float viscosity) {
+        Injection event = { Viscosity_Change, now(), 0, 0, 0.0f, 0.0f, viscosity, 0 };
+        return event;
+    }
+};
+
+/**
+ * Bounded lock-free queue for exactly one producer thread and one consumer
+ * thread. Neither side ever blocks: push fails when the queue is full and
+ * the consumer takes everything queued so far in one batch.
+ */
+template <typename T, size_t Capacity>
+struct Spsc_Queue {
+    static_assert((Capacity & (Capacity - 1)) == 0,
+            "Spsc_Queue capacity must be a power of two");
+
+    Spsc_Queue() : head_(0), tail_(0) {}
+
+    Spsc_Queue(const Spsc_Queue&) = delete;
+    Spsc_Queue& operator = (const Spsc_Queue&) = delete;
+
+    /** Producer: append item, false (and dropped) if the queue is full */
+    bool push(const T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        items_[tail & (Capacity - 1)] = item;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Consumer: call apply on every item pushed before the call, oldest
+     * first, then release their slots in one go
+     * @returns Number of items applied
+     */
+    template <typename Apply>
+    size_t drain(Apply apply) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        for (size_t k = head; k != tail; ++k) {
+            apply(items_[k & (Capacity - 1)]);
+        }
+        head_.store(tail, std::memory_order_release);
+        return tail - head;
+    }
+
+private:
+    T items_[Capacity];
+    // Each index is written by one side only; keep them on separate lines
+    alignas(64) std::atomic<size_t> head_;   // next item to consume
+    alignas(64) std::atomic<size_t> tail_;   // next free slot
+};
+
+/** Input queue of a Fluid_Sim */
+typedef Spsc_Queue<Injection, 1024> Injection_Queue;
+
+#endif // INJECTION_H
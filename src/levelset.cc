@@ -0,0 +1,544 @@
+#include <algorithm>
+#include <cmath>
+#include "bounds.h"
+#include "levelset.h"
+#include "parallel.h"
+
+namespace {
+
+/** Bits of the cells of word w that are interior cells 1 to N */
+uint64_t interior_bits(int w, int N)
+{
+    int lo = std::max(1 - 64 * w, 0);
+    int hi = std::min(N - 64 * w, 63);
+    if (hi < lo) {
+        return 0;
+    }
+    uint64_t below_hi = (hi == 63) ? ~(uint64_t) 0 : ((uint64_t) 1 << (hi + 1)) - 1;
+    return below_hi & ~(((uint64_t) 1 << lo) - 1);
+}
+
+/** Bit r set where bits r and r+1 are, next being the word after */
+uint64_t both_bits(uint64_t word, uint64_t next)
+{
+    return word & (word >> 1 | next << 63);
+}
+
+/** Bit r set where bit r or r+1 is */
+uint64_t either_bits(uint64_t word, uint64_t next)
+{
+    return word | word >> 1 | next << 63;
+}
+
+/** Bit r set where bit r differs from bit r+1, next being the word after */
+uint64_t rising_bits(uint64_t word, uint64_t next)
+{
+    return word ^ (word >> 1 | next << 63);
+}
+
+/** Bit r set where bit r differs from bit r-1, prev being the word before */
+uint64_t falling_bits(uint64_t word, uint64_t prev)
+{
+    return word ^ (word << 1 | prev >> 63);
+}
+
+/** Distance of cells nothing has reached yet */
+const float Far = 1e30f;
+
+/**
+ * Liquid polygon of each marching squares case, counter-clockwise: points
+ * 0 to 3 are the corners of the cell counter-clockwise from its lower
+ * corner, 4 + k the crossing on the edge from corner k to corner k + 1.
+ * Bit k of a case is set when corner k is in liquid. The saddles 5 and 10
+ * join their two liquid corners into one hexagon.
+ */
+const struct {
+    int count;
+    unsigned char points[6];
+} Square_Cases[16] = {
+    { 0, { 0, 0, 0, 0, 0, 0 } },
+    { 3, { 0, 4, 7, 0, 0, 0 } },
+    { 3, { 4, 1, 5, 0, 0, 0 } },
+    { 4, { 0, 1, 5, 7, 0, 0 } },
+    { 3, { 5, 2, 6, 0, 0, 0 } },
+    { 6, { 0, 4, 5, 2, 6, 7 } },
+    { 4, { 4, 1, 2, 6, 0, 0 } },
+    { 5, { 0, 1, 2, 6, 7, 0 } },
+    { 3, { 6, 3, 7, 0, 0, 0 } },
+    { 4, { 0, 4, 6, 3, 0, 0 } },
+    { 6, { 4, 1, 5, 6, 3, 7 } },
+    { 5, { 0, 1, 5, 6, 3, 0 } },
+    { 4, { 5, 2, 3, 7, 0, 0 } },
+    { 5, { 0, 4, 5, 2, 3, 0 } },
+    { 5, { 4, 1, 2, 3, 7, 0 } },
+    { 4, { 0, 1, 2, 3, 0, 0 } },
+};
+
+/** Corners of a cell, counter-clockwise from its lower corner */
+const int Corner_Offsets[4][2] = { {0, 0}, {1, 0}, {1, 1}, {0, 1} };
+
+} // namespace
+
+LevelSet::LevelSet(int N)
+    : N_(N), volume_(0.0f), band_width_(3.0f), max_drift_(1.0f), drift_(0.0f),
+      sweep_rounds_(2), dist_grid(N), words_(0), full_cells_(0)
+{
+    dist_grid.set_all(band_width_); // init out of liquid state, beyond the band
+    classify();
+}
+
+void LevelSet::resize(int N)
+{
+    N_ = N;
+    dist_grid.resize(N);
+    dist_grid.set_all(band_width_); // init out of liquid state, beyond the band
+    classify();
+}
+
+void LevelSet::fill_below(float height)
+{
+    // i is the vertical axis, the one gravity pulls along
+    for (int j = 0; j <= N_ + 1; ++j) {
+        for (int i = 0; i <= N_ + 1; ++i) {
+            dist_grid(i, j) = std::min(std::max(i - height, -band_width_),
+                    band_width_);
+        }
+    }
+    classify();
+}
+
+void LevelSet::classify()
+{
+    int N = N_;
+    words_ = (N + 2 + 63) / 64;
+    inside_.assign((size_t) words_ * (N + 2), 0);
+    tube_index_.assign((size_t) (N + 2) * (N + 2), -1);
+    drift_ = 0.0f;
+
+    // Mask of every row, band cells counted per row to lay the band out
+    std::vector<int> offsets(N + 3, 0);
+    parallel_for(0, N + 2, [&](int j) {
+        uint64_t* row = &inside_[(size_t) words_ * j];
+        int count = 0;
+        for (int i = 0; i <= N + 1; ++i) {
+            float d = dist_grid(i, j);
+            row[i / 64] |= (uint64_t) (d < 0.0f) << (i % 64);
+            count += (i >= 1 && i <= N && j >= 1 && j <= N && std::fabs(d) < band_width_);
+        }
+        offsets[j + 1] = count;
+    });
+    for (int j = 0; j <= N + 1; ++j) {
+        offsets[j + 1] += offsets[j];
+    }
+    band_.resize(offsets[N + 2]);
+    parallel_for(1, N + 1, [&](int j) {
+        int k = offsets[j];
+        for (int i = 1; i <= N; ++i) {
+            if (std::fabs(dist_grid(i, j)) < band_width_) {
+                Level_Cell cell = { i, j };
+                band_[k++] = cell;
+            }
+        }
+    });
+
+    find_surface();
+}
+
+void LevelSet::mirror_bounds()
+{
+    int N = N_;
+    Bounds<None>::apply(dist_grid);
+    for (int k = 0; k <= N + 1; ++k) {
+        set_inside(0, k, dist_grid(0, k) < 0.0f);
+        set_inside(N + 1, k, dist_grid(N + 1, k) < 0.0f);
+        set_inside(k, 0, dist_grid(k, 0) < 0.0f);
+        set_inside(k, N + 1, dist_grid(k, N + 1) < 0.0f);
+    }
+}
+
+void LevelSet::advect(const Fluid_Grid<float>& u, const Fluid_Grid<float>& v,
+        float dt0, float max_velocity)
+{
+    if (band_.empty() && surface_.empty()) {
+        return;
+    }
+    float reach = dt0 * max_velocity;
+    float margin = band_width_ - max_drift_;
+    int steps = reach > margin ? (int) std::ceil(reach / margin) : 1;
+    for (int s = 0; s < steps; ++s) {
+        advect_band(u, v, dt0 / steps, max_velocity);
+    }
+}
+
+void LevelSet::advect_band(const Fluid_Grid<float>& u, const Fluid_Grid<float>& v,
+        float dt0, float max_velocity)
+{
+    // Backtrace every band cell before any of them changes
+    int N = N_;
+    int count = (int) band_.size();
+    advected_.resize(count);
+    parallel_for(0, count, [&](int k) {
+        int i = band_[k].i, j = band_[k].j;
+        float x = std::min(std::max(i - dt0 * u(i, j), 0.5f), N + 0.5f);
+        float y = std::min(std::max(j - dt0 * v(i, j), 0.5f), N + 0.5f);
+        int x_lo = (int) x, y_lo = (int) y;
+        float x_w = x - x_lo, y_w = y - y_lo;
+        float low = (1 - y_w) * dist_grid(x_lo, y_lo) + y_w * dist_grid(x_lo, y_lo + 1);
+        float high = (1 - y_w) * dist_grid(x_lo + 1, y_lo) + y_w * dist_grid(x_lo + 1, y_lo + 1);
+        advected_[k] = (1 - x_w) * low + x_w * high;
+    });
+    for (int k = 0; k < count; ++k) {
+        dist_grid(band_[k].i, band_[k].j) = advected_[k];
+        set_inside(band_[k].i, band_[k].j, advected_[k] < 0.0f);
+    }
+    mirror_bounds();
+    find_surface();
+
+    drift_ += dt0 * max_velocity;
+    if (drift_ >= max_drift_) {
+        redistance();
+    }
+}
+
+void LevelSet::build_tube(int reach)
+{
+    int N = N_;
+    int words = words_;
+    size_t size = (size_t) words * (N + 2);
+
+    // Cells with a neighbour on the other side of the surface, widened by
+    // reach along rows
+    std::vector<uint64_t> wide(size, 0);
+    parallel_for(1, N + 1, [&](int j) {
+        const uint64_t* row = &inside_[(size_t) words * j];
+        uint64_t* out = &wide[(size_t) words * j];
+        for (int w = 0; w < words; ++w) {
+            uint64_t prev = (w > 0) ? row[w - 1] : 0;
+            uint64_t next = (w + 1 < words) ? row[w + 1] : 0;
+            out[w] = (rising_bits(row[w], next) | falling_bits(row[w], prev)
+                    | (row[w] ^ row[w - words]) | (row[w] ^ row[w + words]))
+                    & interior_bits(w, N);
+        }
+        for (int r = 0; r < reach; ++r) {
+            uint64_t carry = 0;
+            for (int w = 0; w < words; ++w) {
+                uint64_t next = (w + 1 < words) ? out[w + 1] : 0;
+                uint64_t word = out[w];
+                out[w] = word | word << 1 | carry | word >> 1 | next << 63;
+                carry = word >> 63;
+            }
+        }
+    });
+
+    // Then along columns, plus the band as it was
+    tube_mask_.assign(size, 0);
+    parallel_for(1, N + 1, [&](int j) {
+        uint64_t* out = &tube_mask_[(size_t) words * j];
+        for (int k = std::max(j - reach, 1); k <= std::min(j + reach, N); ++k) {
+            const uint64_t* row = &wide[(size_t) words * k];
+            for (int w = 0; w < words; ++w) {
+                out[w] |= row[w];
+            }
+        }
+        for (int w = 0; w < words; ++w) {
+            out[w] &= interior_bits(w, N);
+        }
+    });
+    for (size_t k = 0; k < band_.size(); ++k) {
+        tube_mask_[band_[k].i / 64 + (size_t) words * band_[k].j]
+            |= (uint64_t) 1 << (band_[k].i % 64);
+    }
+
+    tube_.clear();
+    tube_rows_.assign(N + 3, 0);
+    for (int j = 0; j <= N + 1; ++j) {
+        tube_rows_[j] = (int) tube_.size();
+        const uint64_t* row = &tube_mask_[(size_t) words * j];
+        for (int w = 0; w < words; ++w) {
+            for (uint64_t bits = row[w]; bits; bits &= bits - 1) {
+                Level_Cell cell = { 64 * w + __builtin_ctzll(bits), j };
+                tube_index_[cell.i + (N + 2) * j] = (int) tube_.size();
+                tube_.push_back(cell);
+            }
+        }
+    }
+    tube_rows_[N + 2] = (int) tube_.size();
+}
+
+void LevelSet::sweep(int direction, std::vector<float>& distance,
+        const std::vector<unsigned char>& fixed) const
+{
+    int N = N_;
+    int stride = N + 2;
+    bool backward_i = direction & 1;
+    bool backward_j = direction & 2;
+    auto at = [&](int i, int j) {
+        int k = tube_index_[i + stride * j];
+        return k >= 0 ? distance[k] : Far;
+    };
+    for (int r = 0; r <= N + 1; ++r) {
+        int j = backward_j ? N + 1 - r : r;
+        int first = tube_rows_[j], last = tube_rows_[j + 1] - 1;
+        for (int n = 0; n <= last - first; ++n) {
+            int k = backward_i ? last - n : first + n;
+            if (fixed[k]) {
+                continue;
+            }
+            int i = tube_[k].i;
+            // Godunov upwind solution of |grad d| = 1 with unit spacing
+            float a = std::min(at(i - 1, j), at(i + 1, j));
+            float b = std::min(at(i, j - 1), at(i, j + 1));
+            if (a > b) {
+                std::swap(a, b);
+            }
+            float d = (b - a >= 1.0f) ? a + 1.0f
+                : 0.5f * (a + b + std::sqrt(2.0f - (b - a) * (b - a)));
+            distance[k] = std::min(distance[k], d);
+        }
+    }
+}
+
+void LevelSet::redistance()
+{
+    drift_ = 0.0f;
+    if (band_.empty() && surface_.empty()) {
+        return;
+    }
+    int N = N_;
+    build_tube((int) std::ceil(band_width_) + 1);
+    int count = (int) tube_.size();
+
+    // Cells next to the surface: the distance to the crossings on their
+    // edges, as linear interpolation puts them
+    std::vector<unsigned char> fixed(count, 0);
+    std::vector<float>& distance = sweep_[0];
+    distance.assign(count, Far);
+    parallel_for(0, count, [&](int k) {
+        int i = tube_[k].i, j = tube_[k].j;
+        float d = dist_grid(i, j);
+        bool inside = is_liquid(i, j);
+        const int offsets[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+        float crossing[2] = { Far, Far };
+        for (int n = 0; n < 4; ++n) {
+            int ni = i + offsets[n][0], nj = j + offsets[n][1];
+            if (is_liquid(ni, nj) != inside) {
+                float t = d / (d - dist_grid(ni, nj));
+                crossing[n / 2] = std::min(crossing[n / 2], std::fabs(t));
+            }
+        }
+        if (crossing[0] < Far || crossing[1] < Far) {
+            float dx = crossing[0], dy = crossing[1];
+            distance[k] = (dx < Far && dy < Far)
+                ? dx * dy / std::max(std::sqrt(dx * dx + dy * dy), 1e-12f)
+                : std::min(dx, dy);
+            fixed[k] = 1;
+        }
+    });
+
+    // The four directions each on a copy of their own, then the smallest
+    for (int round = 0; round < sweep_rounds_; ++round) {
+        for (int s = 1; s < 4; ++s) {
+            sweep_[s] = distance;
+        }
+        parallel_for(0, 4, [&](int s) {
+            sweep(s, sweep_[s], fixed);
+        });
+        parallel_for(0, count, [&](int k) {
+            distance[k] = std::min(std::min(sweep_[0][k], sweep_[1][k]),
+                    std::min(sweep_[2][k], sweep_[3][k]));
+        });
+    }
+
+    // Beyond the band everything reads band_width_, with its sign
+    band_.clear();
+    for (int k = 0; k < count; ++k) {
+        int i = tube_[k].i, j = tube_[k].j;
+        float d = std::min(distance[k], band_width_);
+        if (d < band_width_) {
+            band_.push_back(tube_[k]);
+        }
+        dist_grid(i, j) = is_liquid(i, j) ? -d : d;
+        tube_index_[i + (N + 2) * j] = -1;
+    }
+    mirror_bounds();
+    find_surface();
+}
+
+uint64_t LevelSet::full_bits(int j, int w) const
+{
+    const uint64_t* lower = &inside_[(size_t) words_ * j];
+    const uint64_t* upper = lower + words_;
+    uint64_t next = (w + 1 < words_) ? lower[w + 1] & upper[w + 1] : 0;
+    return both_bits(lower[w] & upper[w], next) & interior_bits(w, N_);
+}
+
+void LevelSet::square_bits(int j, int w, uint64_t* full, uint64_t* surface) const
+{
+    // A marching squares cell is full when all four corners are in liquid,
+    // on the surface when some but not all are
+    const uint64_t* lower = &inside_[(size_t) words_ * j];
+    const uint64_t* upper = lower + words_;
+    uint64_t next_lower = (w + 1 < words_) ? lower[w + 1] : 0;
+    uint64_t next_upper = (w + 1 < words_) ? upper[w + 1] : 0;
+    uint64_t interior = interior_bits(w, N_);
+    *full = both_bits(lower[w] & upper[w], next_lower & next_upper) & interior;
+    *surface = either_bits(lower[w] | upper[w], next_lower | next_upper)
+        & ~*full & interior;
+}
+
+void LevelSet::find_surface()
+{
+    // Rows are classified in parallel, once to count their surface cells
+    // and once more to write them where the counts put them
+    int N = N_;
+    surface_rows_.assign(N + 3, 0);
+    int full_cells = parallel_sum<int>(1, N + 1, [&](int j) {
+        int full_count = 0, count = 0;
+        for (int w = 0; w < words_; ++w) {
+            uint64_t full, surface;
+            square_bits(j, w, &full, &surface);
+            full_count += __builtin_popcountll(full);
+            count += __builtin_popcountll(surface);
+        }
+        surface_rows_[j + 1] = count;
+        return full_count;
+    });
+    for (int j = 0; j <= N + 1; ++j) {
+        surface_rows_[j + 1] += surface_rows_[j];
+    }
+    full_cells_ = full_cells;
+    surface_.resize(surface_rows_[N + 2]);
+    cases_.resize(surface_rows_[N + 2]);
+
+    parallel_for(1, N + 1, [&](int j) {
+        int k = surface_rows_[j];
+        for (int w = 0; w < words_; ++w) {
+            uint64_t full, surface;
+            square_bits(j, w, &full, &surface);
+            for (; surface; surface &= surface - 1) {
+                Level_Cell cell = { 64 * w + __builtin_ctzll(surface), j };
+                int square = 0;
+                for (int c = 0; c < 4; ++c) {
+                    square |= is_liquid(cell.i + Corner_Offsets[c][0],
+                            cell.j + Corner_Offsets[c][1]) << c;
+                }
+                surface_[k] = cell;
+                cases_[k] = (unsigned char) square;
+                ++k;
+            }
+        }
+    });
+}
+
+template <typename F>
+void LevelSet::for_each_run(int j, F f) const
+{
+    // Runs can carry on from one word to the next
+    int first = -1, last = -1;
+    for (int w = 0; w <= words_; ++w) {
+        uint64_t bits = (w < words_) ? full_bits(j, w) : 0;
+        while (true) {
+            int start = bits ? 64 * w + __builtin_ctzll(bits) : 64 * (w + 1);
+            if (first >= 0 && start != last + 1) {
+                f(first, last);
+                first = -1;
+            }
+            if (!bits) {
+                break;
+            }
+            int s = start - 64 * w;
+            uint64_t rest = ~(bits >> s);
+            int length = rest ? __builtin_ctzll(rest) : 64 - s;
+            if (first < 0) {
+                first = start;
+            }
+            last = start + length - 1;
+            bits &= (s + length == 64) ? 0 : ~(uint64_t) 0 << (s + length);
+        }
+    }
+}
+
+int LevelSet::marching_squares(int s, glm::vec2 vertices[6]) const
+{
+    int i = surface_[s].i, j = surface_[s].j;
+    float h = 1.0f / N_;
+    float corners[4];
+    for (int c = 0; c < 4; ++c) {
+        corners[c] = dist_grid(i + Corner_Offsets[c][0], j + Corner_Offsets[c][1]);
+    }
+
+    int count = Square_Cases[cases_[s]].count;
+    for (int v = 0; v < count; ++v) {
+        int point = Square_Cases[cases_[s]].points[v];
+        if (point < 4) {
+            vertices[v] = glm::vec2((i + Corner_Offsets[point][0]) * h,
+                    (j + Corner_Offsets[point][1]) * h);
+            continue;
+        }
+        // Where the distance interpolates to zero along the edge
+        int a = point - 4, b = (a + 1) % 4;
+        float t = corners[a] / (corners[a] - corners[b]);
+        float x = Corner_Offsets[a][0] + t * (Corner_Offsets[b][0] - Corner_Offsets[a][0]);
+        float y = Corner_Offsets[a][1] + t * (Corner_Offsets[b][1] - Corner_Offsets[a][1]);
+        vertices[v] = glm::vec2((i + x) * h, (j + y) * h);
+    }
+    return count;
+}
+
+void LevelSet::extract_surface(bool render)
+{
+    int N = N_;
+    float h = 1.0f / N;
+
+    // Vertices per row: a fan of count - 2 triangles per surface cell, two
+    // triangles per run of full cells
+    if (render) {
+        row_offsets_.assign(N + 3, 0);
+        parallel_for(1, N + 1, [&](int j) {
+            int count = 0;
+            for (int s = surface_rows_[j]; s < surface_rows_[j + 1]; ++s) {
+                count += 3 * (Square_Cases[cases_[s]].count - 2);
+            }
+            for_each_run(j, [&](int, int) { count += 6; });
+            row_offsets_[j + 1] = count;
+        });
+        for (int j = 0; j <= N + 1; ++j) {
+            row_offsets_[j + 1] += row_offsets_[j];
+        }
+        // Keeps its capacity when it shrinks, so it is only reallocated
+        // when the surface outgrows every one before
+        triangles_.resize(row_offsets_[N + 2]);
+    }
+
+    float volume = parallel_sum<float>(1, N + 1, [&](int j) {
+        float row_volume = 0.0f;
+        glm::vec2 polygon[6];
+        glm::vec2* out = render ? triangles_.data() + row_offsets_[j] : 0;
+        for (int s = surface_rows_[j]; s < surface_rows_[j + 1]; ++s) {
+            int count = marching_squares(s, polygon);
+            for (int v = 0; v < count; ++v) {
+                // x1*y2 - x2*y1 + ...
+                const glm::vec2& p = polygon[v];
+                const glm::vec2& q = polygon[(v + 1) % count];
+                row_volume += 0.5f * (p[0] * q[1] - q[0] * p[1]);
+            }
+            if (render) {
+                for (int v = 2; v < count; ++v) {
+                    *out++ = polygon[0];
+                    *out++ = polygon[v - 1];
+                    *out++ = polygon[v];
+                }
+            }
+        }
+        if (render) {
+            for_each_run(j, [&](int first, int last) {
+                glm::vec2 a(first * h, j * h), b((last + 1) * h, j * h);
+                glm::vec2 c((last + 1) * h, (j + 1) * h), d(first * h, (j + 1) * h);
+                *out++ = a; *out++ = b; *out++ = c;
+                *out++ = a; *out++ = c; *out++ = d;
+            });
+        }
+        return row_volume;
+    });
+    volume_ = volume + full_cells_ * h * h;
+}
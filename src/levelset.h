@@ -2,120 +2,174 @@
 #define LEVELSET_H
 
 #include <glm/glm.hpp>
+#include <stdint.h>
 #include <vector>
 #include "grid.h"
 
+/** A cell of the level set grid */
+struct Level_Cell {
+    int i, j;
+};
+
+/**
+ * Liquid surface as the zero crossing of a signed distance field, in cells.
+ * Only a narrow band of cells around the crossing matters, so classify()
+ * records those cells, the marching squares cells the surface passes
+ * through, and a one bit per cell inside/outside mask. Surface extraction,
+ * the volume and gravity then cost time proportional to the length of the
+ * surface and to the packed mask, not to the N^2 cells of the grid.
+ *
+ * advect() moves the band with the flow, and redistance() rebuilds it around
+ * wherever the surface went. Cells outside the band hold band_width_ with
+ * the sign of their side.
+ */
 struct LevelSet {
     int N_;
-    float volume_;
+    float volume_;               // liquid area of the last extract_surface
+    float band_width_;           // cells of distance the band reaches out
+    float max_drift_;            // cells the surface may move between redistances
+    float drift_;                // cells it may have moved since the last one
+    int sweep_rounds_;           // rounds of the four fast sweeping directions
 
     /**
      * Signed distance grid.
      * < 0 indicates below the surface (in liquid) and
      * > 0 indicates above the surface (out of liquid)
      */
-    Fluid_Grid<float> dist_grid; 
-    
-    LevelSet (int N) : N_(N), volume_(0.0f), dist_grid(N)
-    {
-        dist_grid.set_all(1.0f); // init out of liquid state
-    }
-
-    bool is_liquid(int row, int col) {
-        return dist_grid(row, col) < 0.0f;
-    }
+    Fluid_Grid<float> dist_grid;
+
+    int words_;                  // 64 bit words per row of inside_
+    std::vector<uint64_t> inside_; // bit i of row j set where dist_grid(i, j)
+                                   // < 0, rows and columns 0 to N+1
+    std::vector<Level_Cell> band_; // cells with |distance| < band_width_
+    std::vector<Level_Cell> surface_; // marching squares cells, by their
+                                   // lower corner, with corners on both sides
+    std::vector<unsigned char> cases_; // of each surface_ cell, bit k set
+                                   // when corner k is in liquid
+    std::vector<int> surface_rows_; // where each row starts in surface_
+    int full_cells_;             // marching squares cells entirely in liquid
+    std::vector<glm::vec2> triangles_; // liquid as a triangle list, from the
+                                   // last extract_surface that rendered
+
+    LevelSet (int N);
+
+    /** Resize to dimension N, all out of liquid */
+    void resize(int N);
 
     /**
-     * Run marching cubes on given cell 
-     * @returns The number of vertices discovered by algorithm
+     * Rebuild the band, surface cells and mask from dist_grid, after it
+     * was written to
      */
-    int marching_cubes(int row, int col, glm::vec2 vertices[8]) 
-    {
-        int vertex_cnt = 0;
-        float cell_ratio = 1 / (float)N_;
-
-        // Four corners of the cell
-        int idx[4][2] =
-        {
-            {row    , col    },
-            {row + 1, col    },
-            {row + 1, col + 1},
-            {row    , col + 1}
-        };
-
-        for (int i = 0; i < 4; ++i) {
-            // First check if cell is in liquid 
-            if (dist_grid(idx[i][0], idx[i][1]) < 0.0f) {
-                vertices[vertex_cnt][0] = idx[i][0] * cell_ratio;
-                vertices[vertex_cnt][1] = idx[i][1] * cell_ratio;
-                ++vertex_cnt;
-            }
-            
-            // Now check for surface intersections
-            // If signs are opposite then we know that the surface
-            // crosses between these two cells. 
-            int sign = dist_grid(idx[i][0], idx[i][1]) 
-                    *  dist_grid(idx[(i+1)%4][0], idx[(i+1)%4][1]);
-            
-            if (sign < 0.0f) {
-                float dist0 = dist_grid(idx[i][0], idx[i][1]);
-                float dist1 = dist_grid(idx[(i+1)%4][0], idx[(i+1)%4][1]);
-
-                // Get interpolation weight. Subtracting because sign is < 0
-                float p0_weight = dist0 / (dist0 - dist1); 
-
-                // Getting fractional points and interpolating using the weight
-                glm::vec2 p0(idx[i][0] * cell_ratio, idx[i][1] * cell_ratio);
-                glm::vec2 p1(idx[(i+1)%4][0] * cell_ratio, idx[(i+1)%4][1] * cell_ratio);
-
-                // Adding new vertex
-                vertices[vertex_cnt][0] = (1 - p0_weight) * p0[0] + (p0_weight) * p1[0];
-                vertices[vertex_cnt][1] = (1 - p0_weight) * p0[1] + (p0_weight) * p1[1];
-                ++vertex_cnt;
-            }
+    void classify();
 
-        }
-        return vertex_cnt;
-    }
+    /**
+     * Liquid in every cell with i below height, a pool at rest under
+     * gravity, then classify()
+     */
+    void fill_below(float height);
 
-    /** Basic area of a polygon computation */
-    inline float calc_volume(glm::vec2 vertices[8], int cnt) {
-        float volume = 0.0f;
-        for (int i = 0; i < cnt; ++i) {
-            // x1*y2 - x2*y1 + ...
-            volume += (vertices[i][1] * vertices[(i+1)%cnt][0])
-                    - (vertices[i][0] * vertices[(i+1)%cnt][1]); 
-        }
-        return volume / 2.0f;
-    }
+    /**
+     * Semi-Lagrangian advection of the band by velocity (u, v), dt0 cells
+     * per unit of velocity, then a redistance() once the surface may have
+     * drifted max_drift_ cells. Only band cells change, so the surface must
+     * not move further than band_width_ - max_drift_ between them: faster
+     * flows are advected in as many even sub-steps as that takes.
+     * @param max_velocity largest |u| or |v|
+     */
+    void advect(const Fluid_Grid<float>& u, const Fluid_Grid<float>& v,
+            float dt0, float max_velocity);
 
     /**
-     * For each signed distance cell, run my blazingly hyper speed marching
-     * squares algorithm to determine the surface vertices
+     * Make dist_grid a signed distance to the surface again near it, by fast
+     * sweeping over a tube around the surface and the old band. Cells next to
+     * the surface keep the distance their crossings imply; the rest solve
+     * |grad d| = 1 outward from them, sweeping in the four diagonal
+     * directions at once on their own copies and keeping the smallest.
      */
-    void extract_surface(bool render = true) 
-    {
-        glm::vec2 vertices[8]; 
-
-        // Reset global volume
-        volume_ = 0.0f;
-
-        for (int r = 1; r <= N_; ++r) {
-            for (int c = 1; c <= N_; ++c) {
-                int vertex_cnt = marching_cubes(r, c, vertices); 
-                volume_ += calc_volume(vertices, vertex_cnt);
-                if (render) {
-                    render_liquid(vertices);
+    void redistance();
+
+    bool is_liquid(int row, int col) const {
+        return (inside_[row / 64 + words_ * col] >> (row % 64)) & 1;
+    }
+
+    /** Call f(i, j) for every interior cell in liquid, row by row */
+    template <typename F>
+    void for_each_liquid(F f) const {
+        for (int j = 1; j <= N_; ++j) {
+            const uint64_t* row = &inside_[words_ * j];
+            for (int w = 0; w < words_; ++w) {
+                uint64_t bits = row[w];
+                if (w == 0) {
+                    bits &= ~(uint64_t) 1;
+                }
+                while (bits) {
+                    int i = 64 * w + __builtin_ctzll(bits);
+                    if (i > N_) {
+                        break;
+                    }
+                    f(i, j);
+                    bits &= bits - 1;
                 }
             }
         }
     }
 
-    /** Draw Liquid */
-    void render_liquid(glm::vec2 vertices[8]) {
+    /**
+     * Liquid polygon of surface cell s from the marching squares table
+     * @returns The number of vertices, at most 6
+     */
+    int marching_squares(int s, glm::vec2 vertices[6]) const;
 
+    /**
+     * Find volume_, and with render the liquid as triangles_: the polygons
+     * of the surface cells, plus two triangles per run of full cells in a
+     * row of the mask. Rows are counted in parallel first, so each writes
+     * its triangles straight to its place in the buffer, which is then
+     * ready to upload in one go. Needs an up to date classify().
+     */
+    void extract_surface(bool render = true);
+
+private:
+    std::vector<Level_Cell> tube_; // cells redistance() solves for, row major
+    std::vector<int> tube_rows_; // where each row starts in tube_
+    std::vector<int> tube_index_; // per cell its place in tube_, else -1
+    std::vector<uint64_t> tube_mask_;
+    std::vector<float> sweep_[4]; // distances of tube_ per sweep direction
+    std::vector<float> advected_; // new distances of band_
+    std::vector<int> row_offsets_; // per row, where its output starts
+
+    /** One advect() step, which moves the surface no further than allowed */
+    void advect_band(const Fluid_Grid<float>& u, const Fluid_Grid<float>& v,
+            float dt0, float max_velocity);
+
+    /** Bits of row j of the mask for cells whose four corners are in liquid */
+    uint64_t full_bits(int j, int w) const;
+
+    void set_inside(int i, int j, bool inside) {
+        uint64_t bit = (uint64_t) 1 << (i % 64);
+        uint64_t& word = inside_[i / 64 + words_ * j];
+        word = inside ? word | bit : word & ~bit;
     }
 
+    /** Full and surface marching squares cells of word w of row j */
+    void square_bits(int j, int w, uint64_t* full, uint64_t* surface) const;
+
+    /** Surface cells, their cases and full_cells_ from the mask */
+    void find_surface();
+
+    /** Call f(first, last) for every run of full cells in row j */
+    template <typename F>
+    void for_each_run(int j, F f) const;
+
+    /** Mirror dist_grid into its ghost cells, and the mask with it */
+    void mirror_bounds();
+
+    /** Fill tube_ with the cells within reach of the surface or in the band */
+    void build_tube(int reach);
+
+    /** One Gauss-Seidel sweep of the distances in direction 0 to 3 */
+    void sweep(int direction, std::vector<float>& distance,
+            const std::vector<unsigned char>& fixed) const;
 };
 
 #endif // LEVELSET_H
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -12,6 +13,8 @@
 #include "config.h"
 #include "fluid.h"
 #include "heat.h"
+#include "sim_thread.h"
+#include "texture_stream.h"
 
 // OpenGL library includes
 #include <GL/glew.h>
@@ -32,16 +35,27 @@ const char* heat_vertex_shader =
 #include "shaders/heat.vert"
 ;
 
+const char* velocity_vertex_shader =
+#include "shaders/velocity.vert"
+;
+
 const char* heat_fragment_shader =
 #include "shaders/heat.frag"
 ;
 
+const char* liquid_vertex_shader =
+#include "shaders/liquid.vert"
+;
+
 int window_width = 800, window_height = 800;
 
 
 Fluid_Sim fluid_sim(config::N, config::viscosity, config::diffusion, 
         config::time_step);
 
+// Steps fluid_sim and hands finished frames to the render loop
+Sim_Thread sim_thread(fluid_sim);
+
 float quad[] =
 {
     -1.0f,  1.0f, 
@@ -60,37 +74,14 @@ float tex_coords[] =
 
 GLfloat red[] = {1.0f, 0.0f, 0.0f, 1.0f };
 GLfloat field[] = {0.6f, 0.2f, 1.0f, 1.0f };
+GLfloat water[] = {0.1f, 0.4f, 0.9f, 1.0f };
 
 bool show_velocity = false;
 bool show_heat     = false;
 
-std::vector<glm::vec2> generate_velocity_field()
-{
-    std::vector<glm::vec2> vector_field;
-    int length = 3; // line length
-
-    for (int row = 0; row < window_height; row += 5) {
-        for (int col = 0; col < window_width; col += 5) {
-            // Getting simulation-space coordinates
-            int i = (int) ((row / (double) window_height) * (config::N + 2));
-            int j = (int) ((col / (double) window_width)  * (config::N + 2));
-            glm::vec2 p0 = glm::vec2(j/(float)config::N, 
-                                     i/(float)config::N); 
-            float dx = fluid_sim.y(i,j);
-            float dy = fluid_sim.x(i,j);
-            glm::vec2 p1 = glm::vec2((j + dx * length) / (double)config::N,
-                                     (i + dy * length) / (double)config::N);
-            p0[0] = p0[0] * 2 - 1;
-            p0[1] = p0[1] * 2 - 1;
-            p1[0] = p1[0] * 2 - 1;
-            p1[1] = p1[1] * 2 - 1;
-            vector_field.push_back(p0);
-            vector_field.push_back(p1);
-        }
-    }
-    return vector_field;
-
-}
+// Velocity field lines, drawn every few pixels from the velocity texture
+const int velocity_spacing = 5;     // pixels between lines
+const float velocity_length = 3.0f; // cells per unit of velocity
 
 void
 ErrorCallback(int error, const char* description)
@@ -110,6 +101,9 @@ KeyCallback(GLFWwindow* window,
             int action,
             int mods)
 {
+    // Most keys change the simulation, which may be mid-step on its thread
+    std::unique_lock<std::mutex> guard = sim_thread.lock();
+
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, GL_TRUE);
     else if (key == GLFW_KEY_S && mods == GLFW_MOD_CONTROL && action == GLFW_RELEASE) {
@@ -145,14 +139,30 @@ KeyCallback(GLFWwindow* window,
         config::increase_resolution();
         fluid_sim.resize(config::N);
         std::cout << "resolution increase: " << config::N << std::endl;
+    } else if (key == GLFW_KEY_T && action != GLFW_RELEASE) {
+        fluid_sim.adaptive_ = !fluid_sim.adaptive_;
+        std::cout << "Adaptive time stepping "
+                  << (fluid_sim.adaptive_ ? "on, CFL " : "off")
+                  << (fluid_sim.adaptive_ ? std::to_string(fluid_sim.cfl_) : "")
+                  << std::endl;
+    } else if (key == GLFW_KEY_L && action != GLFW_RELEASE) {
+        // Fills the bottom half with liquid, or drains what is there
+        LevelSet& levelset = fluid_sim.levelset;
+        if (levelset.surface_.empty() && levelset.full_cells_ == 0) {
+            std::cout << "Filling liquid" << std::endl;
+            levelset.fill_below(0.5f * fluid_sim.N_);
+        } else {
+            std::cout << "Draining liquid" << std::endl;
+            levelset.resize(fluid_sim.N_);
+        }
     } else if (key == GLFW_KEY_C && action != GLFW_RELEASE) {
     } else if (key == GLFW_KEY_LEFT_BRACKET && action != GLFW_RELEASE) {
         config::decrease_viscosity();
-        fluid_sim.viscosity_grid.set_all(config::viscosity);
+        fluid_sim.inject(Injection::viscosity(config::viscosity));
         std::cout << "viscosity decrease: " << config::viscosity << std::endl;
     } else if (key == GLFW_KEY_RIGHT_BRACKET && action != GLFW_RELEASE) {
         config::increase_viscosity();
-        fluid_sim.viscosity_grid.set_all(config::viscosity);
+        fluid_sim.inject(Injection::viscosity(config::viscosity));
         std::cout << "viscosity increase: " << config::viscosity << std::endl;
     }
 }
@@ -183,16 +193,12 @@ MousePosCallback(GLFWwindow* window, double mouse_x, double mouse_y)
 
     // If dragging the mouse, influence the velocity field
     // If clicking mouse add density AKA add dye
+    // Queued for the next step, never waits on a running one
     if (add_velocity) {
-        fluid_sim.x_old(i, j) = (current_y - prev_y) * 10.0f;
-        fluid_sim.y_old(i, j) = (current_x - prev_x) * 10.0f;
+        fluid_sim.inject(Injection::impulse(i, j, (current_y - prev_y) * 10.0f,
+                    (current_x - prev_x) * 10.0f));
     } else if (add_density) {
-        // fluid_sim.density_old(i, j) = 100.0f;
-        for (int x = max(i - 4, 0); x < min(i + 4, config::N); ++x) {
-            for (int y = max(j - 4, 0); y < min(j + 4, config::N); ++y) {
-                fluid_sim.density_old(x, y) = 250.0f;  
-            }
-        }
+        fluid_sim.inject(Injection::splat(i, j, 250.0f, 4));
     }
 }
 
@@ -207,6 +213,15 @@ MouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 int main(int argc, char* argv[])
 {
     std::string window_title = "Fluid";
+
+    // -sync steps the simulation in the render loop, one step per frame
+    bool async = true;
+    for (int a = 1; a < argc; ++a) {
+        if (std::string(argv[a]) == "-sync") {
+            async = false;
+        }
+    }
+
     if (!glfwInit()) exit(EXIT_FAILURE);
     glfwSetErrorCallback(ErrorCallback);
 
@@ -235,10 +250,8 @@ int main(int argc, char* argv[])
     std::cout << "OpenGL version supported:" << version << "\n";
 
     // Heat boundary 
-    std::vector<glm::vec2> boundary = fluid_sim.heat_boundary_.draw_boundary();
-
-    // Vector field
-    std::vector<glm::vec2> vector_field = generate_velocity_field();
+    std::vector<glm::vec2> boundary = 
+        fluid_sim.heat_boundary_.outline(sim_thread.latest().heat_radius_);
 
     // Setup VBO
     GLuint vbo;
@@ -260,12 +273,9 @@ int main(int argc, char* argv[])
     glBufferData(GL_ARRAY_BUFFER, sizeof(float) * boundary.size() * 2,
             &boundary[0], GL_STATIC_DRAW);
 
-    // Setting up VBO for heat boundary
-    GLuint vector_vbo;
-    glGenBuffers(1, &vector_vbo);  // generate buffer (for heat boundary);
-    glBindBuffer(GL_ARRAY_BUFFER, vector_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vector_field.size() * 2,
-            &vector_field[0], GL_STATIC_DRAW);
+    // Setting up VBO for the liquid, refilled with each new frame's triangles
+    GLuint liquid_vbo;
+    glGenBuffers(1, &liquid_vbo);
 
     // Setup vertex shader
     const char* vertex_source_pointer = vertex_shader;
@@ -297,6 +307,22 @@ int main(int argc, char* argv[])
     glCompileShader(heat_fragment_shader_id);
     CHECK_GL_SHADER_ERROR(heat_fragment_shader_id);
     
+    // Setup velocity vertex shader, its lines come from the velocity texture
+    const char* velocity_vertex_source_pointer = velocity_vertex_shader;
+    GLuint velocity_vertex_shader_id = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(velocity_vertex_shader_id, 1,
+            &velocity_vertex_source_pointer, nullptr);
+    glCompileShader(velocity_vertex_shader_id);
+    CHECK_GL_SHADER_ERROR(velocity_vertex_shader_id);
+
+    // Setup liquid vertex shader, its triangles come from the level set
+    const char* liquid_vertex_source_pointer = liquid_vertex_shader;
+    GLuint liquid_vertex_shader_id = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(liquid_vertex_shader_id, 1,
+            &liquid_vertex_source_pointer, nullptr);
+    glCompileShader(liquid_vertex_shader_id);
+    CHECK_GL_SHADER_ERROR(liquid_vertex_shader_id);
+    
     // Create shader programs
     GLuint program_id = glCreateProgram();
     glAttachShader(program_id, vertex_shader_id);
@@ -311,10 +337,16 @@ int main(int argc, char* argv[])
     CHECK_GL_PROGRAM_ERROR(heat_program_id);
 
     GLuint velocity_program_id = glCreateProgram();
-    glAttachShader(velocity_program_id, heat_vertex_shader_id);
+    glAttachShader(velocity_program_id, velocity_vertex_shader_id);
     glAttachShader(velocity_program_id, heat_fragment_shader_id);
     glLinkProgram(velocity_program_id);
     CHECK_GL_PROGRAM_ERROR(velocity_program_id);
+
+    GLuint liquid_program_id = glCreateProgram();
+    glAttachShader(liquid_program_id, liquid_vertex_shader_id);
+    glAttachShader(liquid_program_id, heat_fragment_shader_id);
+    glLinkProgram(liquid_program_id);
+    CHECK_GL_PROGRAM_ERROR(liquid_program_id);
     
     // Setup Vertex Array Object
     GLuint vao; // vao for dye
@@ -329,33 +361,55 @@ int main(int argc, char* argv[])
     CHECK_GL_ERROR(glGenVertexArrays(1, &velocity_vao));
     CHECK_GL_ERROR(glBindVertexArray(velocity_vao));
 
+    GLuint liquid_vao; // vao for liquid triangles
+    CHECK_GL_ERROR(glGenVertexArrays(1, &liquid_vao));
+    CHECK_GL_ERROR(glBindVertexArray(liquid_vao));
+
     // Bind fragment attributes.
     CHECK_GL_ERROR(glBindFragDataLocation(program_id, 0, "fragment_color")); 
     CHECK_GL_ERROR(glBindFragDataLocation(heat_program_id, 0, "fragment_color")); 
     CHECK_GL_ERROR(glBindFragDataLocation(velocity_program_id, 0, "fragment_color")); 
+    CHECK_GL_ERROR(glBindFragDataLocation(liquid_program_id, 0, "fragment_color")); 
 
     // Setup color uniform
     GLuint heat_color_id     = glGetUniformLocation(heat_program_id, "color");
     GLuint velocity_color_id = glGetUniformLocation(velocity_program_id, "color");
-
-    // Send density texture data
+    GLuint velocity_texture_id = glGetUniformLocation(velocity_program_id, "velocity");
+    GLuint velocity_samples_id = glGetUniformLocation(velocity_program_id, "samples");
+    GLuint velocity_spacing_id = glGetUniformLocation(velocity_program_id, "spacing");
+    GLuint velocity_N_id       = glGetUniformLocation(velocity_program_id, "N");
+    GLuint velocity_length_id  = glGetUniformLocation(velocity_program_id, "line_length");
+    GLuint liquid_color_id     = glGetUniformLocation(liquid_program_id, "color");
+    GLuint liquid_N_id         = glGetUniformLocation(liquid_program_id, "N");
+
+    // Density texture, raw densities streamed in as floats
     GLuint texture_id = glGetUniformLocation(program_id, "textureSampler");
-    GLuint texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 
-        config::N, config::N, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glBindTexture(GL_TEXTURE_2D, 0);    
+    Texture_Stream density_texture(GL_R32F, GL_RED, 1);
+
+    // Velocity texture, (x, y) per cell, ghost cells included
+    Texture_Stream velocity_texture(GL_RG32F, GL_RG, 2);
+    long velocity_step = -1;     // frame in velocity_texture
+
+    long liquid_step = -1;       // frame in liquid_vbo
+    GLsizei liquid_count = 0;    // its vertices
 
     glEnable(GL_TEXTURE_2D);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
+    if (async) {
+        sim_thread.start();
+    }
+
     while (!glfwWindowShouldClose(window)) {
+        if (!async) {
+            sim_thread.step();
+        }
+        // Everything below draws this frame, never the live simulation
+        bool fresh = false;
+        const Frame_Snapshot& frame = sim_thread.latest(&fresh);
+        int N = frame.N_;
+
         // Setup some basic window stuff.
         glfwGetFramebufferSize(window, &window_width, &window_height);
         glViewport(0, 0, window_width, window_height);
@@ -375,7 +429,7 @@ int main(int argc, char* argv[])
         {
             glUseProgram(heat_program_id);
             glBindVertexArray(heat_vao);
-            boundary = fluid_sim.heat_boundary_.draw_boundary();
+            boundary = fluid_sim.heat_boundary_.outline(frame.heat_radius_);
             glEnableVertexAttribArray(0);
             glBindBuffer(GL_ARRAY_BUFFER, heat_vbo);
             glBufferData(GL_ARRAY_BUFFER, sizeof(float) * boundary.size() * 2,
@@ -390,63 +444,90 @@ int main(int argc, char* argv[])
             );
             glUniform4fv(heat_color_id, 1, red);
             glDrawArrays(GL_LINE_LOOP, 0, boundary.size());
-        } else {
-            // Ensure that boundary is updated even if invisible
-            fluid_sim.heat_boundary_.update_boundary(); 
         }
 
         // RENDER VECTOR FIELDS //
         if (show_velocity) 
         {
+            // Uploaded once per new frame, the lines are built on the GPU
+            if (velocity_step != frame.step_
+                    || velocity_texture.width_ != N + 2) {
+                velocity_step = frame.step_;
+                float* texels = velocity_texture.begin(N + 2, N + 2);
+                for (int j = 0; j <= N + 1; ++j) {
+                    float* row = texels + (size_t) 2 * (N + 2) * j;
+                    for (int i = 0; i <= N + 1; ++i) {
+                        row[2 * i]     = frame.x(i, j);
+                        row[2 * i + 1] = frame.y(i, j);
+                    }
+                }
+                velocity_texture.end();
+            }
+
             glUseProgram(velocity_program_id);
             glBindVertexArray(velocity_vao);
-            vector_field = generate_velocity_field();
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, velocity_texture.texture_);
+            glUniform1i(velocity_texture_id, 0);
+
+            // A line from every velocity_spacing-th pixel, as one instance
+            int columns = (window_width + velocity_spacing - 1) / velocity_spacing;
+            int rows = (window_height + velocity_spacing - 1) / velocity_spacing;
+            glUniform2i(velocity_samples_id, columns, rows);
+            glUniform2f(velocity_spacing_id,
+                    velocity_spacing / (float) window_width,
+                    velocity_spacing / (float) window_height);
+            glUniform1i(velocity_N_id, N);
+            glUniform1f(velocity_length_id, velocity_length);
+            glUniform4fv(velocity_color_id, 1, field);
+            glDrawArraysInstanced(GL_LINES, 0, 2, columns * rows);
+        }
+
+        // RENDER LIQUID //
+        // A new frame's triangles go up in one call; drawn ahead of the dye
+        // so that they win the depth test
+        if (liquid_step != frame.step_) {
+            liquid_step = frame.step_;
+            liquid_count = (GLsizei) frame.liquid_.size();
+            glBindBuffer(GL_ARRAY_BUFFER, liquid_vbo);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec2) * liquid_count,
+                    frame.liquid_.data(), GL_STREAM_DRAW);
+        }
+        if (liquid_count > 0)
+        {
+            glUseProgram(liquid_program_id);
+            glBindVertexArray(liquid_vao);
             glEnableVertexAttribArray(0);
-            glBindBuffer(GL_ARRAY_BUFFER, vector_vbo);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vector_field.size() * 2,
-                    &vector_field[0], GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, liquid_vbo);
             glVertexAttribPointer(
-                        0, 
+                        0,
                         2,
                         GL_FLOAT,
                         GL_FALSE,
                         0,
                         (void*)0
             );
-            glUniform4fv(velocity_color_id, 1, field);
-            glDrawArrays(GL_LINES, 0, vector_field.size());
+            glUniform1i(liquid_N_id, N);
+            glUniform4fv(liquid_color_id, 1, water);
+            glDrawArrays(GL_TRIANGLES, 0, liquid_count);
         }
 
         
         // RENDER FLUID //
-        fluid_sim.simulation_step();
-        // fluid_sim.debug_print(fluid_sim.viscosity_grid);
-
         glUseProgram(program_id); 
 
-        // Passing in texture
-        glActiveTexture(GL_TEXTURE0);
-        int pixels[config::N][config::N];
-        float sum = 0.0;
-        // _Pragma("omp parallel for")
-        for (int i = 1; i <= config::N; ++i) {
-            for (int j = 1; j <= config::N; ++j) {
-                pixels[i-1][j-1] = min((int)fluid_sim.density(i, j), 255); 
-                sum += fluid_sim.x(i,j);
+        // Passing in texture, a row of the grid per texture row; only new
+        // frames are uploaded, the shader does the colour mapping
+        if (fresh || density_texture.width_ != N) {
+            float* texels = density_texture.begin(N, N);
+            for (int j = 1; j <= N; ++j) {
+                std::copy(&frame.density(1, j), &frame.density(1, j) + N,
+                        texels + (size_t) (j - 1) * N);
             }
+            density_texture.end();
         }
-        //std::cout << "density sum:  " << sum << std::endl;
-        // sum = 0.0f;
-        // for (int i = 0; i <= config::N+1; ++i) {
-        //     for (int j = 0; j <= config::N+1; ++j) {
-        //         sum += fluid_sim.density(i,j);
-        //     }
-        // }
-        // std::cout << "density sum 2:  " << sum << std::endl;
-
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, config::N, config::N, GL_RGBA,
-                GL_UNSIGNED_BYTE, pixels);
-        glBindTexture(GL_TEXTURE_2D, texture);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, density_texture.texture_);
         glUniform1i(texture_id, 0);
  
         glBindVertexArray(vao);       
@@ -482,6 +563,7 @@ int main(int argc, char* argv[])
         glfwPollEvents();
         glfwSwapBuffers(window);
     }
+    sim_thread.stop();
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
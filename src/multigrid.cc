@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cmath>
+#include "multigrid.h"
+
+namespace {
+
+/** Red-black Gauss-Seidel sweeps */
+void smooth(Fluid_Grid<float>& x, Fluid_Grid<float>& rhs, int sweeps)
+{
+    int N = x.N_;
+    for (int step = 0; step < sweeps; ++step) {
+        for (int color = 0; color < 2; ++color) {
+            parallel_for(1, N + 1, [&](int j) {
+                for (int i = 1 + ((j + 1 + color) & 1); i <= N; i += 2) {
+                    x(i, j) = 0.25f * (rhs(i, j) + x(i-1, j) + x(i+1, j)
+                            + x(i, j-1) + x(i, j+1));
+                }
+            });
+        }
+        neumann_bounds(x);
+    }
+}
+
+/** r = rhs - A x, returns max |r| */
+float residual(Fluid_Grid<float>& x, Fluid_Grid<float>& rhs, Fluid_Grid<float>& r)
+{
+    int N = x.N_;
+    return parallel_max<float>(1, N + 1, [&](int j) {
+        float max_r = 0.0f;
+        for (int i = 1; i <= N; ++i) {
+            r(i, j) = rhs(i, j) - (4 * x(i, j) - x(i-1, j) - x(i+1, j)
+                    - x(i, j-1) - x(i, j+1));
+            max_r = std::max(max_r, std::fabs(r(i, j)));
+        }
+        return max_r;
+    });
+}
+
+/**
+ * Coarse rhs is the sum of the fine 2x2 block -- the average, times the
+ * (2h/h)^2 = 4 by which the unscaled stencil grows on the coarse grid
+ */
+void restrict_residual(Fluid_Grid<float>& fine, Fluid_Grid<float>& coarse)
+{
+    int N = fine.N_, Nc = coarse.N_;
+    parallel_for(1, Nc + 1, [&](int J) {
+        for (int I = 1; I <= Nc; ++I) {
+            float sum = 0.0f;
+            for (int j = 2*J - 1; j <= std::min(2*J, N); ++j) {
+                for (int i = 2*I - 1; i <= std::min(2*I, N); ++i) {
+                    sum += fine(i, j);
+                }
+            }
+            coarse(I, J) = sum;
+        }
+    });
+}
+
+/** Bilinearly interpolate the coarse correction and add it to fine */
+void prolong_correction(Fluid_Grid<float>& coarse, Fluid_Grid<float>& fine)
+{
+    int N = fine.N_;
+    neumann_bounds(coarse);
+    parallel_for(1, N + 1, [&](int j) {
+        int J  = (j + 1) / 2;
+        int J2 = (j & 1) ? J - 1 : J + 1; // nearer coarse neighbour
+        for (int i = 1; i <= N; ++i) {
+            int I  = (i + 1) / 2;
+            int I2 = (i & 1) ? I - 1 : I + 1;
+            fine(i, j) += 0.5625f * coarse(I,  J)
+                        + 0.1875f * (coarse(I2, J) + coarse(I, J2))
+                        + 0.0625f * coarse(I2, J2);
+        }
+    });
+}
+
+} // namespace
+
+Multigrid::Multigrid()
+    : cycle_(V_Cycle), pre_smooth_(2), post_smooth_(2), coarse_sweeps_(30)
+{
+    control_.tolerance = 1e-3f;
+    control_.max_iterations = 20;
+    stats_.iterations = 0;
+    stats_.residual = 0.0f;
+}
+
+void Multigrid::build_levels(int N)
+{
+    x_.clear();
+    rhs_.clear();
+    residual_.clear();
+
+    // Finest level solves into the caller's grids
+    x_.push_back(Grid_Ptr());
+    rhs_.push_back(Grid_Ptr());
+    residual_.push_back(Grid_Ptr(new Fluid_Grid<float>(N)));
+
+    while (N > 4) {
+        N = (N + 1) / 2;
+        x_.push_back(Grid_Ptr(new Fluid_Grid<float>(N)));
+        rhs_.push_back(Grid_Ptr(new Fluid_Grid<float>(N)));
+        residual_.push_back(Grid_Ptr(new Fluid_Grid<float>(N)));
+    }
+}
+
+void Multigrid::cycle(int level, Fluid_Grid<float>& x, Fluid_Grid<float>& rhs)
+{
+    if (level + 1 == (int) residual_.size()) {
+        smooth(x, rhs, coarse_sweeps_);
+        return;
+    }
+
+    smooth(x, rhs, pre_smooth_);
+
+    Fluid_Grid<float>& coarse_x = *x_[level + 1];
+    Fluid_Grid<float>& coarse_rhs = *rhs_[level + 1];
+    residual(x, rhs, *residual_[level]);
+    restrict_residual(*residual_[level], coarse_rhs);
+    coarse_x.reset();
+    for (int c = 0; c < cycle_; ++c) {
+        cycle(level + 1, coarse_x, coarse_rhs);
+    }
+    prolong_correction(coarse_x, x);
+    neumann_bounds(x);
+
+    smooth(x, rhs, post_smooth_);
+}
+
+Solver_Stats Multigrid::solve(Fluid_Grid<float>& p, Fluid_Grid<float>& rhs)
+{
+    if (residual_.empty() || residual_[0]->N_ != p.N_) {
+        build_levels(p.N_);
+    }
+
+    remove_mean(rhs);
+    neumann_bounds(p);
+
+    stats_.iterations = 0;
+    float rhs_norm = max_norm(rhs);
+    if (rhs_norm == 0.0f) {
+        // Pressure is only defined up to a constant; zero is as good as any
+        p.reset();
+        stats_.residual = 0.0f;
+        return stats_;
+    }
+
+    float r = residual(p, rhs, *residual_[0]) / rhs_norm;
+    while (r > control_.tolerance && stats_.iterations < control_.max_iterations) {
+        cycle(0, p, rhs);
+        r = residual(p, rhs, *residual_[0]) / rhs_norm;
+        ++stats_.iterations;
+    }
+    stats_.residual = r;
+    return stats_;
+}
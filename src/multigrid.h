@@ -0,0 +1,55 @@
+#ifndef MULTIGRID_H
+#define MULTIGRID_H
+
+#include <memory>
+#include <vector>
+#include "grid.h"
+#include "solver.h"
+
+/**
+ * Number of coarse grid corrections per level
+ */
+enum Cycle_Type
+{
+    V_Cycle = 1,
+    W_Cycle = 2
+};
+
+/**
+ * Geometric multigrid solver for the pressure equation of Fluid_Sim::project
+ *
+ *   4 p(i,j) - p(i-1,j) - p(i+1,j) - p(i,j-1) - p(i,j+1) = rhs(i,j)
+ *
+ * with copy (Neumann) boundaries. Cell-centered hierarchy: each coarse level
+ * has (N+1)/2 cells a side, residuals are restricted by summing 2x2 blocks
+ * and corrections are prolonged bilinearly. Red-black Gauss-Seidel is used
+ * as the smoother, so every kernel is parallel.
+ */
+struct Multigrid {
+    Cycle_Type cycle_;
+    int pre_smooth_;             // smoothing sweeps before restriction
+    int post_smooth_;            // smoothing sweeps after prolongation
+    int coarse_sweeps_;          // sweeps spent on the coarsest level
+    Solver_Control control_;     // relative residual target and cycle cap
+    Solver_Stats stats_;         // result of the last solve
+
+    Multigrid();
+
+    /**
+     * Solve for p, using its current contents as the initial guess.
+     * The mean of rhs is removed first, since the pure Neumann problem
+     * only has a solution for zero-mean right hand sides.
+     */
+    Solver_Stats solve(Fluid_Grid<float>& p, Fluid_Grid<float>& rhs);
+
+private:
+    typedef std::unique_ptr<Fluid_Grid<float> > Grid_Ptr;
+
+    // Per level storage. x_[0] and rhs_[0] are the caller's grids.
+    std::vector<Grid_Ptr> x_, rhs_, residual_;
+
+    void build_levels(int N);
+    void cycle(int level, Fluid_Grid<float>& x, Fluid_Grid<float>& rhs);
+};
+
+#endif // MULTIGRID_H
@@ -0,0 +1,121 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Parallel loops that work both on their own and from inside an OpenMP task.
+ * Outside a parallel region each loop is a parallel region of its own. Inside
+ * one, as in a stage of a parallel Task_Graph run, the iterations become
+ * tasks of the team already running rather than an inactive nested region
+ * on a single thread, so every stage in flight shares the same threads.
+ * With a single thread to run on they are plain loops. None of them may be
+ * called by every thread of a team at once.
+ */
+
+/** for (i = begin; i < end; ++i) f(i) on the OpenMP threads */
+template <typename F>
+void parallel_for(int begin, int end, F f)
+{
+#ifdef _OPENMP
+    if (omp_in_parallel()) {
+        if (omp_get_num_threads() > 1) {
+            _Pragma("omp taskloop")
+            for (int i = begin; i < end; ++i) {
+                f(i);
+            }
+            return;
+        }
+    } else if (omp_get_max_threads() > 1) {
+        _Pragma("omp parallel for")
+        for (int i = begin; i < end; ++i) {
+            f(i);
+        }
+        return;
+    }
+#endif
+    for (int i = begin; i < end; ++i) {
+        f(i);
+    }
+}
+
+/** The largest of zero and f(i) for i in [begin, end) */
+template <typename T, typename F>
+T parallel_max(int begin, int end, F f)
+{
+    T result = T();
+#ifdef _OPENMP
+    if (omp_in_parallel()) {
+        if (omp_get_num_threads() > 1) {
+            _Pragma("omp taskloop reduction(max:result)")
+            for (int i = begin; i < end; ++i) {
+                result = std::max(result, f(i));
+            }
+            return result;
+        }
+    } else if (omp_get_max_threads() > 1) {
+        _Pragma("omp parallel for reduction(max:result)")
+        for (int i = begin; i < end; ++i) {
+            result = std::max(result, f(i));
+        }
+        return result;
+    }
+#endif
+    for (int i = begin; i < end; ++i) {
+        result = std::max(result, f(i));
+    }
+    return result;
+}
+
+/** Sum of f(i) for i in [begin, end) */
+template <typename T, typename F>
+T parallel_sum(int begin, int end, F f)
+{
+    T result = T();
+#ifdef _OPENMP
+    if (omp_in_parallel()) {
+        if (omp_get_num_threads() > 1) {
+            _Pragma("omp taskloop reduction(+:result)")
+            for (int i = begin; i < end; ++i) {
+                result += f(i);
+            }
+            return result;
+        }
+    } else if (omp_get_max_threads() > 1) {
+        _Pragma("omp parallel for reduction(+:result)")
+        for (int i = begin; i < end; ++i) {
+            result += f(i);
+        }
+        return result;
+    }
+#endif
+    for (int i = begin; i < end; ++i) {
+        result += f(i);
+    }
+    return result;
+}
+
+/**
+ * Run f on one thread of a team, so that the many short parallel loops of
+ * a solver are tasks of that team rather than a parallel region each.
+ * Inside a parallel region f just runs, its loops on the team already there.
+ */
+template <typename F>
+void with_team(F f)
+{
+#ifdef _OPENMP
+    if (!omp_in_parallel() && omp_get_max_threads() > 1) {
+        _Pragma("omp parallel")
+        _Pragma("omp single")
+        f();
+        return;
+    }
+#endif
+    f();
+}
+
+#endif // PARALLEL_H
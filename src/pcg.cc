@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cmath>
+#include "pcg.h"
+
+namespace {
+
+/** Sum of a .* b over the interior */
+double dot(Fluid_Grid<float>& a, Fluid_Grid<float>& b)
+{
+    int N = a.N_;
+    return parallel_sum<double>(1, N + 1, [&](int j) {
+        double sum = 0.0;
+        for (int i = 1; i <= N; ++i) {
+            sum += (double) a(i, j) * b(i, j);
+        }
+        return sum;
+    });
+}
+
+/**
+ * out = A s. Copying s into its ghost cells first makes the 5-point stencil
+ * equal to the Neumann operator, whose diagonal drops on boundary cells.
+ */
+void apply_matrix(Fluid_Grid<float>& s, Fluid_Grid<float>& out)
+{
+    int N = s.N_;
+    neumann_bounds(s);
+    parallel_for(1, N + 1, [&](int j) {
+        for (int i = 1; i <= N; ++i) {
+            out(i, j) = 4 * s(i, j) - s(i-1, j) - s(i+1, j) - s(i, j-1) - s(i, j+1);
+        }
+    });
+}
+
+/** Diagonal of the Neumann operator: number of interior neighbours */
+inline float diagonal(int i, int j, int N)
+{
+    return 4.0f - (i == 1) - (i == N) - (j == 1) - (j == N);
+}
+
+} // namespace
+
+PCG::PCG() : preconditioner_(MIC_Preconditioner), mic_tuning_(0.97f),
+    mic_safety_(0.25f), N_(0)
+{
+    control_.tolerance = 1e-3f;
+    control_.max_iterations = 200;
+    stats_.iterations = 0;
+    stats_.residual = 0.0f;
+}
+
+void PCG::build(int N)
+{
+    N_ = N;
+    r_.reset(new Fluid_Grid<float>(N));
+    z_.reset(new Fluid_Grid<float>(N));
+    s_.reset(new Fluid_Grid<float>(N));
+    mic_.reset();
+}
+
+/**
+ * MIC(0) factorization, after Bridson's "Fluid Simulation for Computer
+ * Graphics". Off-diagonals are -1 between interior neighbours, so the
+ * factorization only depends on N and is kept until the next resize.
+ */
+void PCG::build_mic()
+{
+    int N = N_;
+    mic_.reset(new Fluid_Grid<float>(N));
+    Fluid_Grid<float>& precon = *mic_;
+
+    for (int j = 1; j <= N; ++j) {
+        for (int i = 1; i <= N; ++i) {
+            float diag = diagonal(i, j, N);
+            float e = diag;
+            if (i > 1) {
+                // A(i-1,j -> i,j) = -1, and A(i-1,j -> i-1,j+1) = -1 if it exists
+                float p = precon(i-1, j);
+                e -= p * p;
+                if (j < N) e -= mic_tuning_ * p * p;
+            }
+            if (j > 1) {
+                float p = precon(i, j-1);
+                e -= p * p;
+                if (i < N) e -= mic_tuning_ * p * p;
+            }
+            if (e < mic_safety_ * diag) {
+                e = diag;
+            }
+            precon(i, j) = 1.0f / std::sqrt(e);
+        }
+    }
+}
+
+void PCG::apply_preconditioner(Fluid_Grid<float>& r, Fluid_Grid<float>& z)
+{
+    int N = N_;
+    if (preconditioner_ == Jacobi_Preconditioner) {
+        parallel_for(1, N + 1, [&](int j) {
+            for (int i = 1; i <= N; ++i) {
+                z(i, j) = r(i, j) / diagonal(i, j, N);
+            }
+        });
+        return;
+    }
+
+    if (!mic_) {
+        build_mic();
+    }
+    Fluid_Grid<float>& precon = *mic_;
+
+    // Solve L q = r. Off-diagonals are -1, so they enter with a plus sign.
+    // Ghost cells of precon and z are zero, which drops missing neighbours.
+    for (int j = 1; j <= N; ++j) {
+        for (int i = 1; i <= N; ++i) {
+            float t = r(i, j) + precon(i-1, j) * z(i-1, j)
+                              + precon(i, j-1) * z(i, j-1);
+            z(i, j) = t * precon(i, j);
+        }
+    }
+    // Solve L^T z = q in place
+    for (int j = N; j >= 1; --j) {
+        for (int i = N; i >= 1; --i) {
+            float t = z(i, j) + precon(i, j) * (z(i+1, j) + z(i, j+1));
+            z(i, j) = t * precon(i, j);
+        }
+    }
+}
+
+Solver_Stats PCG::solve(Fluid_Grid<float>& p, Fluid_Grid<float>& rhs)
+{
+    if (N_ != p.N_) {
+        build(p.N_);
+    }
+    int N = N_;
+    Fluid_Grid<float>& r = *r_;
+    Fluid_Grid<float>& z = *z_;
+    Fluid_Grid<float>& s = *s_;
+
+    remove_mean(rhs);
+    stats_.iterations = 0;
+    stats_.residual = 0.0f;
+
+    float rhs_norm = max_norm(rhs);
+    if (rhs_norm == 0.0f) {
+        // Pressure is only defined up to a constant; zero is as good as any
+        p.reset();
+        return stats_;
+    }
+
+    // r = rhs - A p
+    apply_matrix(p, z);
+    parallel_for(1, N + 1, [&](int j) {
+        for (int i = 1; i <= N; ++i) {
+            r(i, j) = rhs(i, j) - z(i, j);
+        }
+    });
+    stats_.residual = max_norm(r) / rhs_norm;
+    if (stats_.residual <= control_.tolerance) {
+        neumann_bounds(p);
+        return stats_;
+    }
+
+    // The triangular solves read the ghost cells of z. Nothing ever writes
+    // them, so they keep the zeros they were allocated with.
+    apply_preconditioner(r, z);
+    parallel_for(1, N + 1, [&](int j) {
+        for (int i = 1; i <= N; ++i) {
+            s(i, j) = z(i, j);
+        }
+    });
+    double sigma = dot(z, r);
+
+    while (stats_.iterations < control_.max_iterations) {
+        ++stats_.iterations;
+
+        apply_matrix(s, z);
+        double s_dot_z = dot(s, z);
+        if (s_dot_z == 0.0) {
+            break;
+        }
+        float alpha = (float) (sigma / s_dot_z);
+
+        float max_r = parallel_max<float>(1, N + 1, [&](int j) {
+            float row_max = 0.0f;
+            for (int i = 1; i <= N; ++i) {
+                p(i, j) += alpha * s(i, j);
+                r(i, j) -= alpha * z(i, j);
+                row_max = std::max(row_max, std::fabs(r(i, j)));
+            }
+            return row_max;
+        });
+        stats_.residual = max_r / rhs_norm;
+        if (stats_.residual <= control_.tolerance) {
+            break;
+        }
+
+        apply_preconditioner(r, z);
+        double sigma_new = dot(z, r);
+        float beta = (float) (sigma_new / sigma);
+        sigma = sigma_new;
+        parallel_for(1, N + 1, [&](int j) {
+            for (int i = 1; i <= N; ++i) {
+                s(i, j) = z(i, j) + beta * s(i, j);
+            }
+        });
+    }
+    neumann_bounds(p);
+    return stats_;
+}
@@ -0,0 +1,55 @@
+#ifndef PCG_H
+#define PCG_H
+
+#include <memory>
+#include "grid.h"
+#include "solver.h"
+
+/**
+ * Preconditioners available to the conjugate gradient solver
+ */
+enum Preconditioner
+{
+    Jacobi_Preconditioner, // diagonal scaling, fully parallel
+    MIC_Preconditioner     // modified incomplete Cholesky, sequential sweeps
+};
+
+/**
+ * Matrix-free preconditioned conjugate gradient solver for the same pressure
+ * equation as Multigrid:
+ *
+ *   4 p(i,j) - p(i-1,j) - p(i+1,j) - p(i,j-1) - p(i,j+1) = rhs(i,j)
+ *
+ * with copy (Neumann) boundaries, i.e. the diagonal of the matrix is the
+ * number of interior neighbours of a cell. Iterates until the max-norm
+ * residual drops below control_.tolerance relative to the rhs.
+ */
+struct PCG {
+    Preconditioner preconditioner_;
+    float mic_tuning_;           // MIC(0) tau, 0 gives plain IC(0)
+    float mic_safety_;           // MIC(0) sigma, guards small pivots
+    Solver_Control control_;     // relative residual target and iteration cap
+    Solver_Stats stats_;         // result of the last solve
+
+    PCG();
+
+    /**
+     * Solve for p, using its current contents as the initial guess.
+     * The mean of rhs is removed first, since the pure Neumann problem
+     * only has a solution for zero-mean right hand sides.
+     */
+    Solver_Stats solve(Fluid_Grid<float>& p, Fluid_Grid<float>& rhs);
+
+private:
+    typedef std::unique_ptr<Fluid_Grid<float> > Grid_Ptr;
+
+    int N_;                      // dimension the work grids were built for
+    Grid_Ptr r_, z_, s_;         // residual, preconditioned residual, search
+    Grid_Ptr mic_;               // MIC(0) inverse pivots, built per N
+
+    void build(int N);
+    void build_mic();
+    void apply_preconditioner(Fluid_Grid<float>& r, Fluid_Grid<float>& z);
+};
+
+#endif // PCG_H
@@ -4,7 +4,8 @@ in vec2 UV;
 uniform sampler2D textureSampler;
 out vec4 fragment_color;
 void main() {
-    float density = texture(textureSampler, UV).r;
+    // Texture rows are grid rows j, so the screen's x is the texture's y
+    float density = clamp(texture(textureSampler, UV.yx).r, 0.0, 255.0) / 255.0;
     float factor = log2(density*.80 + 1.0f);
     float r = 1.5f * factor;
     float g = 1.5 * factor * factor;
@@ -0,0 +1,12 @@
+R"zzz(
+#version 330 core
+// Liquid triangles of LevelSet::extract_surface, (i, j) / N per vertex
+layout(location = 0) in vec2 vertex_position;
+uniform int N;
+void main() {
+	// j runs across the screen and i up it; cell (i, j) is centred on its
+	// density texel, half a cell in from the corner of its square
+	vec2 p = vertex_position.yx - 0.5 / N;
+	gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+}
+)zzz"
@@ -0,0 +1,19 @@
+R"zzz(
+#version 330 core
+// One line per instance, from a sample point along the velocity there
+uniform sampler2D velocity;      // (x, y) of cell (i, j) at texel (i, j)
+uniform ivec2 samples;           // sample points across and up the window
+uniform vec2 spacing;            // window fraction between sample points
+uniform int N;
+uniform float line_length;       // cells per unit of velocity
+void main() {
+	ivec2 point = ivec2(gl_InstanceID % samples.x, gl_InstanceID / samples.x);
+	int i = int(point.y * spacing.y * (N + 2));
+	int j = int(point.x * spacing.x * (N + 2));
+	vec2 p = vec2(j, i);
+	if (gl_VertexID == 1) {
+		p += texelFetch(velocity, ivec2(i, j), 0).yx * line_length;
+	}
+	gl_Position = vec4(p / N * 2.0 - 1.0, 0.0, 1.0);
+}
+)zzz"
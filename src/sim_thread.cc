@@ -0,0 +1,149 @@
+#include <algorithm>
+#include "sim_thread.h"
+
+Frame_Snapshot::Frame_Snapshot()
+    : N_(0), step_(0), heat_radius_(0.0f),
+      density(0, Density), x(0, X_Velocity), y(0, Y_Velocity)
+{
+}
+
+void Frame_Snapshot::capture(Fluid_Sim& sim, long step)
+{
+    int N = sim.N_;
+    if (N_ != N) {
+        N_ = N;
+        density.resize(N);
+        x.resize(N);
+        y.resize(N);
+    }
+    step_ = step;
+    heat_radius_ = sim.heat_boundary_.radius();
+
+    // Only a level set with liquid in it has triangles to draw
+    LevelSet& levelset = sim.levelset;
+    if (levelset.surface_.empty() && levelset.full_cells_ == 0) {
+        liquid_.clear();
+    } else {
+        levelset.extract_surface(true);
+        liquid_.assign(levelset.triangles_.begin(), levelset.triangles_.end());
+    }
+
+    // Row by row, the arena may lay rows out with a different stride
+    for (int j = 0; j <= N + 1; ++j) {
+        std::copy(&sim.density(0, j), &sim.density(0, j) + N + 2, &density(0, j));
+        std::copy(&sim.x(0, j),       &sim.x(0, j) + N + 2,       &x(0, j));
+        std::copy(&sim.y(0, j),       &sim.y(0, j) + N + 2,       &y(0, j));
+    }
+}
+
+Snapshot_Buffer::Snapshot_Buffer() : back_(0), front_(1), ready_(2)
+{
+}
+
+void Snapshot_Buffer::publish()
+{
+    // Release makes the frame contents visible to the reader that swaps it in
+    back_ = ready_.exchange(back_ | Fresh, std::memory_order_acq_rel) & Index_Mask;
+}
+
+const Frame_Snapshot& Snapshot_Buffer::latest(bool* fresh)
+{
+    bool is_fresh = (ready_.load(std::memory_order_relaxed) & Fresh) != 0;
+    if (is_fresh) {
+        front_ = ready_.exchange(front_, std::memory_order_acq_rel) & Index_Mask;
+    }
+    if (fresh) {
+        *fresh = is_fresh;
+    }
+    return frames_[front_];
+}
+
+Sim_Thread::Sim_Thread(Fluid_Sim& sim)
+    : sim_(sim), running_(false), waiting_(0), steps_(0)
+{
+    // The renderer has something to draw before the first step finishes
+    frames_.back().capture(sim_, steps_);
+    frames_.publish();
+}
+
+Sim_Thread::~Sim_Thread()
+{
+    stop();
+}
+
+void Sim_Thread::start()
+{
+    if (running_) {
+        return;
+    }
+    running_ = true;
+    thread_ = std::thread(&Sim_Thread::run, this);
+}
+
+void Sim_Thread::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(read_mutex_);
+        running_ = false;
+    }
+    read_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+const Frame_Snapshot& Sim_Thread::latest(bool* fresh)
+{
+    bool is_fresh = false;
+    const Frame_Snapshot& frame = frames_.latest(&is_fresh);
+    if (is_fresh) {
+        // Under the mutex, so the thread cannot miss it between its check
+        // and its wait
+        {
+            std::lock_guard<std::mutex> guard(read_mutex_);
+        }
+        read_.notify_one();
+    }
+    if (fresh) {
+        *fresh = is_fresh;
+    }
+    return frame;
+}
+
+std::unique_lock<std::mutex> Sim_Thread::lock()
+{
+    ++waiting_;
+    std::unique_lock<std::mutex> guard(mutex_);
+    --waiting_;
+    return guard;
+}
+
+void Sim_Thread::step()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        sim_.advance_frame();
+        // The heat boundary expands once per step, and so once per
+        // displayed frame
+        sim_.heat_boundary_.update_boundary();
+        ++steps_;
+        frames_.back().capture(sim_, steps_);
+    }
+    frames_.publish();
+}
+
+void Sim_Thread::run()
+{
+    while (running_) {
+        step();
+        // Idle until the renderer has taken the frame just published
+        {
+            std::unique_lock<std::mutex> guard(read_mutex_);
+            read_.wait(guard, [this] { return !frames_.unread() || !running_; });
+        }
+        // std::mutex is not fair; let queued callers in before relocking
+        while (waiting_ > 0 && running_) {
+            std::this_thread::yield();
+        }
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef SIM_THREAD_H
+#define SIM_THREAD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "fluid.h"
+#include "grid.h"
+
+/**
+ * The part of a finished simulation step the renderer needs
+ */
+struct Frame_Snapshot {
+    int N_;
+    long step_;                  // steps simulated when the frame was taken
+    float heat_radius_;          // heat boundary radius at that step
+    Fluid_Grid<float> density, x, y;
+    std::vector<glm::vec2> liquid_; // LevelSet::triangles_ at that step
+
+    Frame_Snapshot();
+
+    /** Copy the displayed fields out of sim, resizing first if N changed */
+    void capture(Fluid_Sim& sim, long step);
+};
+
+/**
+ * Lock-free triple buffer between one writer (the simulation) and one
+ * reader (the renderer). The writer always has a spare frame to fill and
+ * the reader always gets the newest published one; neither ever waits.
+ */
+struct Snapshot_Buffer {
+    Snapshot_Buffer();
+
+    /** Writer: the frame to fill next */
+    Frame_Snapshot& back() { return frames_[back_]; }
+
+    /** Writer: hand the filled frame over and take a spare one */
+    void publish();
+
+    /**
+     * Reader: the newest published frame. It stays valid and unchanged
+     * until the next call.
+     * @param fresh if given, set to whether a new frame arrived since then
+     */
+    const Frame_Snapshot& latest(bool* fresh = 0);
+
+    /** Whether a published frame is still waiting for the reader */
+    bool unread() const {
+        return (ready_.load(std::memory_order_acquire) & Fresh) != 0;
+    }
+
+private:
+    enum { Index_Mask = 3, Fresh = 4 };
+
+    Frame_Snapshot frames_[3];
+    int back_;                   // owned by the writer
+    int front_;                  // owned by the reader
+    std::atomic<int> ready_;     // last published frame, | Fresh until read
+};
+
+/**
+ * Runs Fluid_Sim steps on a thread of its own and publishes every finished
+ * step to a Snapshot_Buffer, so drawing and waiting for vsync never hold
+ * up the solver. step() does the same on the calling thread for a serial
+ * main loop.
+ *
+ * The thread keeps at most one step ahead of the renderer: it computes the
+ * next frame while the current one is drawn, then waits for latest() to
+ * take it. The simulation so still advances one step per displayed frame.
+ *
+ * Anything else touching the simulation must hold lock(); it is released
+ * between steps.
+ */
+struct Sim_Thread {
+    explicit Sim_Thread(Fluid_Sim& sim);
+    ~Sim_Thread();
+
+    Sim_Thread(const Sim_Thread&) = delete;
+    Sim_Thread& operator = (const Sim_Thread&) = delete;
+
+    /** Start stepping in the background, no-op if already running */
+    void start();
+
+    /** Finish the current step and join the thread */
+    void stop();
+
+    bool running() const { return running_; }
+
+    /** Run and publish a single step on the calling thread */
+    void step();
+
+    /**
+     * Newest finished frame, see Snapshot_Buffer::latest. Taking a new one
+     * lets the thread start on the step after it.
+     */
+    const Frame_Snapshot& latest(bool* fresh = 0);
+
+    /** Exclusive access to the simulation, granted between two steps */
+    std::unique_lock<std::mutex> lock();
+
+private:
+    Fluid_Sim& sim_;
+    Snapshot_Buffer frames_;
+    std::mutex mutex_;
+    std::thread thread_;
+    std::atomic<bool> running_;
+    std::atomic<int> waiting_;   // threads queued in lock()
+    std::mutex read_mutex_;      // guards the wait for the reader
+    std::condition_variable read_; // signalled when latest() takes a frame
+    long steps_;
+
+    void run();
+};
+
+#endif // SIM_THREAD_H
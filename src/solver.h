@@ -0,0 +1,68 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include <algorithm>
+#include <cmath>
+#include "bounds.h"
+#include "grid.h"
+#include "parallel.h"
+
+/**
+ * Convergence criteria for an iterative linear solver
+ */
+struct Solver_Control {
+    float tolerance;    // stop once |residual| <= tolerance * |rhs|
+    int max_iterations; // hard cap on iterations (or cycles)
+};
+
+/**
+ * What an iterative linear solver did on its last solve
+ */
+struct Solver_Stats {
+    int iterations;     // iterations (or cycles) actually run
+    float residual;     // final max-norm residual, relative to |rhs|
+};
+
+/*
+ * Kernels shared by the pressure solvers
+ */
+
+/** Copy boundaries, same as Fluid_Sim::adjust_bounds on a None grid */
+inline void neumann_bounds(Fluid_Grid<float>& grid)
+{
+    Bounds<None>::apply(grid);
+}
+
+/** Max |v| over the interior */
+inline float max_norm(Fluid_Grid<float>& grid)
+{
+    int N = grid.N_;
+    return parallel_max<float>(1, N + 1, [&](int j) {
+        float max_v = 0.0f;
+        for (int i = 1; i <= N; ++i) {
+            max_v = std::max(max_v, std::fabs(grid(i, j)));
+        }
+        return max_v;
+    });
+}
+
+/** Shift the interior so it sums to zero */
+inline void remove_mean(Fluid_Grid<float>& grid)
+{
+    int N = grid.N_;
+    double sum = parallel_sum<double>(1, N + 1, [&](int j) {
+        double row_sum = 0.0;
+        for (int i = 1; i <= N; ++i) {
+            row_sum += grid(i, j);
+        }
+        return row_sum;
+    });
+    float mean = (float) (sum / ((double) N * N));
+    parallel_for(1, N + 1, [&](int j) {
+        for (int i = 1; i <= N; ++i) {
+            grid(i, j) -= mean;
+        }
+    });
+}
+
+#endif // SOLVER_H
@@ -0,0 +1,68 @@
+#ifndef SOURCES_H
+#define SOURCES_H
+
+#include <algorithm>
+#include <vector>
+#include "grid.h"
+
+/**
+ * External sources of one field. Values live in a grid that is zero except
+ * where a source was set; each row remembers the span of columns written to
+ * it since the last flush, so applying and clearing the sources only ever
+ * touches those cells.
+ */
+struct Source_Grid {
+    Fluid_Grid<float> grid_;
+
+    /** Source grid drawn from arena; call resize() after every layout */
+    explicit Source_Grid(Grid_Arena<float>& arena) : grid_(arena) {}
+
+    /** Forget all spans, for a freshly zeroed grid of dimension N */
+    void resize(int N) {
+        first_.assign(N + 2, N + 2);
+        last_.assign(N + 2, -1);
+    }
+
+    /** Set the source of cell (i, j), replacing any earlier value */
+    void set(int i, int j, float value) {
+        grid_(i, j) = value;
+        first_[j] = std::min(first_[j], i);
+        last_[j] = std::max(last_[j], i);
+    }
+
+    /** target += scale * sources, keeping the sources */
+    void add(Fluid_Grid<float>& target, float scale) const {
+        for (int j = 0; j < (int) first_.size(); ++j) {
+            for (int i = first_[j]; i <= last_[j]; ++i) {
+                target(i, j) += grid_(i, j) * scale;
+            }
+        }
+    }
+
+    /** target += scale * sources, then clear the sources */
+    void flush(Fluid_Grid<float>& target, float scale) {
+        add(target, scale);
+        clear();
+    }
+
+    /** Drop the sources without applying them */
+    void clear() {
+        for (int j = 0; j < (int) first_.size(); ++j) {
+            for (int i = first_[j]; i <= last_[j]; ++i) {
+                grid_(i, j) = 0.0f;
+            }
+        }
+        clear_spans();
+    }
+
+private:
+    std::vector<int> first_;     // per row, first written column
+    std::vector<int> last_;      // per row, last written column, -1 if none
+
+    void clear_spans() {
+        std::fill(first_.begin(), first_.end(), (int) first_.size());
+        std::fill(last_.begin(), last_.end(), -1);
+    }
+};
+
+#endif // SOURCES_H
@@ -0,0 +1,131 @@
+#include <chrono>
+#include <utility>
+#include "task_graph.h"
+
+namespace {
+
+double seconds()
+{
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+int Task_Graph::add(const char* name, std::function<void()> work)
+{
+    Task task;
+    task.name_ = name;
+    task.work_ = std::move(work);
+    task.inputs_ = 0;
+    task.start_ = task.end_ = 0.0;
+    task.thread_ = 0;
+    tasks_.push_back(std::move(task));
+    return (int) tasks_.size() - 1;
+}
+
+void Task_Graph::depend(int task, int on)
+{
+    tasks_[on].next_.push_back(task);
+    ++tasks_[task].inputs_;
+}
+
+void Task_Graph::run(bool parallel)
+{
+    size_t count = tasks_.size();
+    double origin = seconds();
+    if (!parallel) {
+        for (size_t t = 0; t < count; ++t) {
+            execute((int) t, origin);
+        }
+        elapsed_ = seconds() - origin;
+        return;
+    }
+
+    pending_.resize(count);
+    for (size_t t = 0; t < count; ++t) {
+        pending_[t] = tasks_[t].inputs_;
+    }
+    // The implicit barrier at the end waits for every task, however deep
+    // in the graph it was spawned
+    _Pragma("omp parallel")
+    _Pragma("omp single")
+    {
+        for (size_t t = 0; t < count; ++t) {
+            if (tasks_[t].inputs_ == 0) {
+                spawn((int) t, origin);
+            }
+        }
+    }
+    elapsed_ = seconds() - origin;
+}
+
+void Task_Graph::spawn(int t, double origin)
+{
+    _Pragma("omp task firstprivate(t, origin)")
+    {
+        execute(t, origin);
+        const std::vector<int>& next = tasks_[t].next_;
+        for (size_t k = 0; k < next.size(); ++k) {
+            // Whoever finishes the last input starts the task; acq_rel
+            // makes the writes of every input visible to it
+            int left;
+            _Pragma("omp atomic capture acq_rel")
+            left = --pending_[next[k]];
+            if (left == 0) {
+                spawn(next[k], origin);
+            }
+        }
+    }
+}
+
+void Task_Graph::execute(int t, double origin)
+{
+    Task& task = tasks_[t];
+    task.start_ = seconds() - origin;
+    task.work_();
+    task.end_ = seconds() - origin;
+#ifdef _OPENMP
+    task.thread_ = omp_get_thread_num();
+#endif
+}
+
+double Task_Graph::busy() const
+{
+    double sum = 0.0;
+    for (size_t t = 0; t < tasks_.size(); ++t) {
+        sum += duration((int) t);
+    }
+    return sum;
+}
+
+double Task_Graph::critical_path(std::vector<int>* path) const
+{
+    // Ids are in dependency order, so one pass finds the longest chain
+    // ending at each task
+    size_t count = tasks_.size();
+    std::vector<double> finish(count, 0.0);
+    std::vector<int> before(count, -1);
+    int last = -1;
+    for (size_t t = 0; t < count; ++t) {
+        finish[t] += duration((int) t);
+        for (size_t k = 0; k < tasks_[t].next_.size(); ++k) {
+            int next = tasks_[t].next_[k];
+            if (finish[t] > finish[next] || before[next] < 0) {
+                finish[next] = finish[t];
+                before[next] = (int) t;
+            }
+        }
+        if (last < 0 || finish[t] > finish[last]) {
+            last = (int) t;
+        }
+    }
+
+    if (path) {
+        path->clear();
+        for (int t = last; t >= 0; t = before[t]) {
+            path->insert(path->begin(), t);
+        }
+    }
+    return last < 0 ? 0.0 : finish[last];
+}
@@ -0,0 +1,84 @@
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+#include <functional>
+#include <vector>
+#include "parallel.h"
+
+/**
+ * Named tasks and the dependencies between them. A task can only depend on
+ * tasks added before it, so the graph is acyclic and the order of the ids
+ * is always a valid order to run the tasks in.
+ *
+ * run(true) makes each task an OpenMP task of one team as soon as the last
+ * of its inputs finishes, whatever else is still running. The work of a
+ * task must keep to the loops of parallel.h, which then become tasks of
+ * the same team, so the tasks in flight and their loops share its threads.
+ */
+struct Task_Graph {
+    /** One task, and when and where its last run happened */
+    struct Task {
+        const char* name_;
+        std::function<void()> work_;
+        std::vector<int> next_;      // tasks that depend on this one
+        int inputs_;                 // tasks this one depends on
+        double start_, end_;         // seconds since the start of the run
+        int thread_;                 // OpenMP thread that ran it
+    };
+
+    std::vector<Task> tasks_;
+
+    Task_Graph() : elapsed_(0.0) {}
+
+    Task_Graph(const Task_Graph&) = delete;
+    Task_Graph& operator = (const Task_Graph&) = delete;
+
+    /** Drop every task */
+    void clear() { tasks_.clear(); }
+
+    /**
+     * Add a task running work
+     * @returns Id of the task, to depend on it
+     */
+    int add(const char* name, std::function<void()> work);
+
+    /** Make task wait for task on, which must have been added before it */
+    void depend(int task, int on);
+
+    /**
+     * Run every task once, and return when all have finished
+     * @param parallel false to run them one by one, in the order added
+     */
+    void run(bool parallel);
+
+    /** Seconds the last run took */
+    double elapsed() const { return elapsed_; }
+
+    /** Seconds task t took in the last run */
+    double duration(int t) const { return tasks_[t].end_ - tasks_[t].start_; }
+
+    /**
+     * Seconds of all tasks of the last run added up: over elapsed(), how
+     * many tasks were in flight on average
+     */
+    double busy() const;
+
+    /**
+     * The chain of dependent tasks with the most time in it in the last
+     * run: no schedule of the same tasks finishes sooner
+     * @returns Seconds on the chain, with the chain itself in path
+     */
+    double critical_path(std::vector<int>* path = 0) const;
+
+private:
+    double elapsed_;
+    std::vector<int> pending_;   // per task, dependencies left
+
+    /** Run task t */
+    void execute(int t, double origin);
+
+    /** Run task t as an OpenMP task, then start the ones it was last input of */
+    void spawn(int t, double origin);
+};
+
+#endif // TASK_GRAPH_H
@@ -0,0 +1,131 @@
+#include "texture_stream.h"
+
+namespace {
+
+/** Nanoseconds to wait on a fence before asking again */
+const GLuint64 Fence_Timeout = 1000000;
+
+} // namespace
+
+Texture_Stream::Texture_Stream(GLint internal_format, GLenum format,
+        int channels)
+    : texture_(0), width_(0), height_(0), internal_format_(internal_format),
+      format_(format), channels_(channels),
+      persistent_(GLEW_ARB_buffer_storage), slot_(0)
+{
+    for (int s = 0; s < Slots; ++s) {
+        buffers_[s] = 0;
+        mapped_[s] = 0;
+        fences_[s] = 0;
+    }
+    glGenTextures(1, &texture_);
+    glBindTexture(GL_TEXTURE_2D, texture_);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+Texture_Stream::~Texture_Stream()
+{
+    release();
+    glDeleteTextures(1, &texture_);
+}
+
+void Texture_Stream::release()
+{
+    for (int s = 0; s < Slots; ++s) {
+        if (fences_[s]) {
+            glDeleteSync(fences_[s]);
+        }
+        if (mapped_[s]) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers_[s]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        fences_[s] = 0;
+        mapped_[s] = 0;
+    }
+    if (buffers_[0]) {
+        glDeleteBuffers(Slots, buffers_);
+    }
+    for (int s = 0; s < Slots; ++s) {
+        buffers_[s] = 0;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void Texture_Stream::allocate(int width, int height)
+{
+    release();
+    width_ = width;
+    height_ = height;
+
+    glBindTexture(GL_TEXTURE_2D, texture_);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format_, width_, height_, 0,
+            format_, GL_FLOAT, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenBuffers(Slots, buffers_);
+    for (int s = 0; s < Slots; ++s) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers_[s]);
+        if (persistent_) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT
+                | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, bytes(), NULL, flags);
+            mapped_[s] = static_cast<float*>(glMapBufferRange(
+                        GL_PIXEL_UNPACK_BUFFER, 0, bytes(), flags));
+        } else {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes(), NULL, GL_STREAM_DRAW);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+float* Texture_Stream::begin(int width, int height)
+{
+    if (width != width_ || height != height_) {
+        allocate(width, height);
+    }
+    slot_ = (slot_ + 1) % Slots;
+
+    if (persistent_) {
+        // Only waits when the GPU is Slots frames behind
+        GLsync& fence = fences_[slot_];
+        if (fence) {
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                        Fence_Timeout) == GL_TIMEOUT_EXPIRED) {
+            }
+            glDeleteSync(fence);
+            fence = 0;
+        }
+        return mapped_[slot_];
+    }
+
+    // Orphan the old storage so the map never waits on a pending upload
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers_[slot_]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes(), NULL, GL_STREAM_DRAW);
+    void* memory = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes(),
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return static_cast<float*>(memory);
+}
+
+void Texture_Stream::end()
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers_[slot_]);
+    if (!persistent_) {
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+
+    // Sourced from the bound buffer, the pointer is an offset into it
+    glBindTexture(GL_TEXTURE_2D, texture_);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width_, height_, format_,
+            GL_FLOAT, (void*) 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (persistent_) {
+        fences_[slot_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
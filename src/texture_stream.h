@@ -0,0 +1,64 @@
+#ifndef TEXTURE_STREAM_H
+#define TEXTURE_STREAM_H
+
+#include <cstddef>
+#include <GL/glew.h>
+
+/**
+ * A float texture refilled every frame through a ring of pixel unpack
+ * buffers. The caller writes texels straight into buffer memory between
+ * begin() and end(), and the copy into the texture then happens on the GPU
+ * while the next frames are drawn, instead of stalling glTexSubImage2D.
+ *
+ * With ARB_buffer_storage the buffers are mapped once, persistently, and a
+ * fence per buffer keeps a slot from being rewritten before the GPU has read
+ * it. Without it each frame orphans and maps its slot instead.
+ */
+struct Texture_Stream {
+    enum { Slots = 3 };
+
+    GLuint texture_;
+    int width_, height_;         // texels, 0 until the first begin()
+
+    /**
+     * @param internal_format GL_R32F, GL_RG32F, ...
+     * @param format GL_RED, GL_RG, ... matching channels
+     * @param channels floats per texel
+     */
+    Texture_Stream(GLint internal_format, GLenum format, int channels);
+    ~Texture_Stream();
+
+    Texture_Stream(const Texture_Stream&) = delete;
+    Texture_Stream& operator = (const Texture_Stream&) = delete;
+
+    /**
+     * Memory to write the next width x height texels to, row after row with
+     * no padding. Reallocates the texture when its size changes.
+     */
+    float* begin(int width, int height);
+
+    /** Upload what was written since begin() into texture_ */
+    void end();
+
+private:
+    GLint internal_format_;
+    GLenum format_;
+    int channels_;
+    bool persistent_;            // buffers stay mapped, fenced per slot
+    int slot_;                   // slot of the last begin()
+    GLuint buffers_[Slots];
+    float* mapped_[Slots];       // persistent mappings of buffers_
+    GLsync fences_[Slots];       // GPU reads of each slot still pending
+
+    size_t bytes() const {
+        return sizeof(float) * channels_ * width_ * height_;
+    }
+
+    /** Drop the buffers and fences */
+    void release();
+
+    /** Texture and buffers for a width x height texture */
+    void allocate(int width, int height);
+};
+
+#endif // TEXTURE_STREAM_H
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include "parallel.h"
+#include "tiles.h"
+
+void Tile_Map::resize(int N)
+{
+    N_ = N;
+    tiles_ = (N + Tile_Size - 1) / Tile_Size;
+    max_.assign(tiles_ * tiles_, 0.0f);
+    active_.assign(tiles_ * tiles_, 1);
+    bits_.assign(tiles_ * tiles_, 0);
+}
+
+void Tile_Map::measure(const Fluid_Grid<float>& grid)
+{
+    if (N_ != grid.N_) {
+        resize(grid.N_);
+    }
+    parallel_for(0, tiles_, [&](int ty) {
+        measure_row(grid, ty);
+    });
+}
+
+void Tile_Map::measure_row(const Fluid_Grid<float>& grid, int ty)
+{
+    // Edge tiles also cover the ghost cells behind them
+    int N = N_;
+    int j0 = (ty == 0) ? 0 : first(ty);
+    int j1 = (ty == tiles_ - 1) ? N + 1 : last(ty);
+    // Row ty of bits_ is this call's alone, so rows measure in parallel
+    uint32_t* bits = &bits_[tiles_ * ty];
+    std::fill(bits, bits + tiles_, 0u);
+    for (int j = j0; j <= j1; ++j) {
+        // With the sign bit cleared, float bits order like the floats
+        // themselves, and an integer max is cheap to vectorize. The bits
+        // are read with memcpy, which compiles to a plain load
+        const float* row = &grid(0, j);
+        for (int tx = 0; tx < tiles_; ++tx) {
+            uint32_t m = bits[tx];
+            if (tx > 0 && tx < tiles_ - 1) {
+                // Whole tile: a fixed trip count the compiler unrolls
+                const float* cells = row + first(tx);
+                for (int k = 0; k < Tile_Size; ++k) {
+                    uint32_t b;
+                    memcpy(&b, &cells[k], sizeof(b));
+                    m = std::max(m, b & 0x7fffffffu);
+                }
+            } else {
+                int i0 = (tx == 0) ? 0 : first(tx);
+                int i1 = (tx == tiles_ - 1) ? N + 1 : last(tx);
+                for (int i = i0; i <= i1; ++i) {
+                    uint32_t b;
+                    memcpy(&b, &row[i], sizeof(b));
+                    m = std::max(m, b & 0x7fffffffu);
+                }
+            }
+            bits[tx] = m;
+        }
+    }
+    for (int tx = 0; tx < tiles_; ++tx) {
+        memcpy(&max_[tx + tiles_ * ty], &bits[tx], sizeof(float));
+    }
+}
+
+float Tile_Map::peak() const
+{
+    float m = 0.0f;
+    for (size_t t = 0; t < max_.size(); ++t) {
+        m = std::max(m, max_[t]);
+    }
+    return m;
+}
+
+void Tile_Map::merge(const Tile_Map& other)
+{
+    for (size_t t = 0; t < max_.size(); ++t) {
+        max_[t] = std::max(max_[t], other.max_[t]);
+    }
+}
+
+int Tile_Map::dilate(float threshold, int reach)
+{
+    return parallel_sum<int>(0, tiles_, [&](int ty) {
+        int count = 0;
+        for (int tx = 0; tx < tiles_; ++tx) {
+            bool awake = false;
+            int y0 = std::max(ty - reach, 0), y1 = std::min(ty + reach, tiles_ - 1);
+            int x0 = std::max(tx - reach, 0), x1 = std::min(tx + reach, tiles_ - 1);
+            for (int y = y0; y <= y1 && !awake; ++y) {
+                for (int x = x0; x <= x1 && !awake; ++x) {
+                    awake = max(x, y) > threshold;
+                }
+            }
+            active_[tx + tiles_ * ty] = awake;
+            count += awake;
+        }
+        return count;
+    });
+}
+
+void Tile_Map::zero_inactive(Fluid_Grid<float>& grid) const
+{
+    parallel_for(1, N_ + 1, [&](int j) {
+        int ty = tile_of(j);
+        for (int tx = 0; tx < tiles_; ++tx) {
+            if (!active(tx, ty)) {
+                std::fill(&grid(first(tx), j), &grid(last(tx), j) + 1, 0.0f);
+            }
+        }
+    });
+}
+
+int advect_activity(Tile_Map& out, const Tile_Map& prev, const Tile_Map& u,
+        const Tile_Map& v, float dt0, float threshold)
+{
+    if (out.N_ != prev.N_) {
+        out.resize(prev.N_);
+    }
+    int tiles = out.tiles_;
+    return parallel_sum<int>(0, tiles, [&](int ty) {
+        int count = 0;
+        for (int tx = 0; tx < tiles; ++tx) {
+            // Cells a backtrace can read: dt0 |velocity| away, and the next
+            // cell over for the bilinear stencil
+            float reach_x = std::ceil(dt0 * u.max(tx, ty)) + 1;
+            float reach_y = std::ceil(dt0 * v.max(tx, ty)) + 1;
+            int rx = (int) std::min<float>(std::ceil(reach_x / Tile_Size), tiles);
+            int ry = (int) std::min<float>(std::ceil(reach_y / Tile_Size), tiles);
+
+            bool awake = false;
+            int y0 = std::max(ty - ry, 0), y1 = std::min(ty + ry, tiles - 1);
+            int x0 = std::max(tx - rx, 0), x1 = std::min(tx + rx, tiles - 1);
+            for (int y = y0; y <= y1 && !awake; ++y) {
+                for (int x = x0; x <= x1 && !awake; ++x) {
+                    awake = prev.max(x, y) > threshold;
+                }
+            }
+            out.active_[tx + tiles * ty] = awake;
+            count += awake;
+        }
+        return count;
+    });
+}
@@ -0,0 +1,77 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <stdint.h>
+#include <vector>
+#include "grid.h"
+
+/** Cells per side of an activity tile */
+const int Tile_Size = 16;
+
+/**
+ * Per-tile activity of a grid: the max magnitude over each Tile_Size^2
+ * block of interior cells, plus the ghost cells next to the edge tiles, and
+ * the set of tiles a kernel should process. Kernels leave inactive tiles
+ * at zero instead of computing them.
+ */
+struct Tile_Map {
+    int N_;                      // grid dimension the map was built for
+    int tiles_;                  // tiles per side
+    std::vector<float> max_;     // max |value| per tile, row major
+    std::vector<unsigned char> active_; // tiles to process, row major
+
+    Tile_Map() : N_(0), tiles_(0) {}
+
+    void resize(int N);
+
+    /** First and last interior cell of tile t along either axis */
+    int first(int t) const { return 1 + t * Tile_Size; }
+    int last(int t) const { return (t + 1) * Tile_Size < N_ ? (t + 1) * Tile_Size : N_; }
+
+    /** Tile holding interior cell k along either axis */
+    static int tile_of(int k) { return (k - 1) / Tile_Size; }
+
+    float max(int tx, int ty) const { return max_[tx + tiles_ * ty]; }
+    bool active(int tx, int ty) const { return active_[tx + tiles_ * ty] != 0; }
+
+    /** Recompute max_ from grid, resizing the map if needed */
+    void measure(const Fluid_Grid<float>& grid);
+
+    /**
+     * Recompute max_ of the tiles in row ty only, for kernels that measure
+     * their output while it is still in cache. The map must be sized for grid.
+     */
+    void measure_row(const Fluid_Grid<float>& grid, int ty);
+
+    /** Largest max_ of all tiles */
+    float peak() const;
+
+    /** max_ = max(max_, other.max_) tile by tile, for a map of the same N */
+    void merge(const Tile_Map& other);
+
+    /**
+     * Activate every tile within reach tiles (Chebyshev distance) of a
+     * tile whose max_ is above threshold
+     * @returns Number of active tiles
+     */
+    int dilate(float threshold, int reach);
+
+    /** Zero the interior cells of every inactive tile of grid */
+    void zero_inactive(Fluid_Grid<float>& grid) const;
+
+private:
+    std::vector<uint32_t> bits_; // measure_row scratch, a row per tile row
+};
+
+/**
+ * Activity of a semi-Lagrangian advection out = advect(prev, u, v): a
+ * tile is active when a backtrace from any of its cells can reach a tile of
+ * prev above threshold. The reach of a tile is bounded by dt0 times its own
+ * max velocity, plus one cell for the interpolation stencil, so inflow from
+ * upstream wakes a tile before the dye arrives.
+ * @returns Number of active tiles in out
+ */
+int advect_activity(Tile_Map& out, const Tile_Map& prev, const Tile_Map& u,
+        const Tile_Map& v, float dt0, float threshold);
+
+#endif // TILES_H